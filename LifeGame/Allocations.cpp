@@ -0,0 +1,141 @@
+//
+//  Allocations.cpp
+//  LifeGame
+//
+
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+#include "Allocations.hpp"
+
+#if defined(LIFEGAME_COUNT_ALLOCATIONS)
+
+//Plain data, so reading it from operator new never allocates itself.
+static thread_local uint64_t count = 0;
+
+uint64_t Allocations::Count() {
+    return count;
+}
+
+bool Allocations::Counted() {
+    return true;
+}
+
+//Every form of new and delete is replaced, so none of them pairs with the library's own.
+void *operator new(std::size_t size) {
+    count++;
+    if (size == 0) size = 1;
+    while (true) {
+        void *memory = std::malloc(size);
+        if (memory != nullptr) return memory;
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr) throw std::bad_alloc();
+        handler();
+    }
+}
+
+void *operator new[](std::size_t size) {
+    return operator new(size);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+    try {
+        return operator new(size);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+    return operator new(size, std::nothrow);
+}
+
+void operator delete(void *memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete[](void *memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void *memory, std::size_t) noexcept {
+    std::free(memory);
+}
+
+void operator delete[](void *memory, std::size_t) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void *memory, const std::nothrow_t &) noexcept {
+    std::free(memory);
+}
+
+void operator delete[](void *memory, const std::nothrow_t &) noexcept {
+    std::free(memory);
+}
+
+#if defined(__cpp_aligned_new)
+//malloc only aligns for the fundamental types, so the block is larger and keeps the pointer malloc returned in front of the aligned one.
+void *operator new(std::size_t size, std::align_val_t align) {
+    const std::size_t alignment = std::max(static_cast<std::size_t>(align), alignof(void *));
+    void *block = operator new(size + alignment + sizeof(void *));
+    const uintptr_t start = reinterpret_cast<uintptr_t>(block) + sizeof(void *);
+    void **memory = reinterpret_cast<void **>((start + alignment - 1) & ~(alignment - 1));
+    memory[-1] = block;
+    return memory;
+}
+
+void *operator new[](std::size_t size, std::align_val_t align) {
+    return operator new(size, align);
+}
+
+void *operator new(std::size_t size, std::align_val_t align, const std::nothrow_t &) noexcept {
+    try {
+        return operator new(size, align);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void *operator new[](std::size_t size, std::align_val_t align, const std::nothrow_t &) noexcept {
+    return operator new(size, align, std::nothrow);
+}
+
+void operator delete(void *memory, std::align_val_t) noexcept {
+    if (memory != nullptr) {
+        std::free(static_cast<void **>(memory)[-1]);
+    }
+}
+
+void operator delete[](void *memory, std::align_val_t align) noexcept {
+    operator delete(memory, align);
+}
+
+void operator delete(void *memory, std::size_t, std::align_val_t align) noexcept {
+    operator delete(memory, align);
+}
+
+void operator delete[](void *memory, std::size_t, std::align_val_t align) noexcept {
+    operator delete(memory, align);
+}
+
+void operator delete(void *memory, std::align_val_t align, const std::nothrow_t &) noexcept {
+    operator delete(memory, align);
+}
+
+void operator delete[](void *memory, std::align_val_t align, const std::nothrow_t &) noexcept {
+    operator delete(memory, align);
+}
+#endif
+
+#else
+
+uint64_t Allocations::Count() {
+    return 0;
+}
+
+bool Allocations::Counted() {
+    return false;
+}
+
+#endif
@@ -0,0 +1,31 @@
+//
+//  Allocations.hpp
+//  LifeGame
+//
+
+#ifndef Allocations_hpp
+#define Allocations_hpp
+
+#include <stdint.h>
+
+//Counts the calls to the global operator new made by the calling thread.
+//Only builds with LIFEGAME_COUNT_ALLOCATIONS defined replace operator new to count them; elsewhere the count stays zero.
+class Allocations {
+public:
+    static uint64_t Count();
+    static bool Counted();
+};
+
+//Adds the allocations the current thread makes during its lifetime to total.
+class AllocationScope {
+    uint64_t &total;
+    const uint64_t start;
+
+public:
+    explicit AllocationScope(uint64_t &total) : total(total), start(Allocations::Count()) {}
+    AllocationScope(const AllocationScope &other) = delete;
+    AllocationScope &operator = (const AllocationScope &other) = delete;
+    ~AllocationScope() { total += Allocations::Count() - start; }
+};
+
+#endif /* Allocations_hpp */
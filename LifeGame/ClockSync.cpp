@@ -0,0 +1,36 @@
+//
+//  ClockSync.cpp
+//  LifeGame
+//
+
+#include "ClockSync.hpp"
+
+namespace Messaging {
+
+    void ClockSync::AddSample(uint64_t sent, uint64_t remoteReceived, uint64_t remoteSent, uint64_t received) {
+        if (received < sent || remoteSent < remoteReceived) return;
+        const uint64_t held = remoteSent - remoteReceived;
+        if (received - sent < held) return;
+        const uint64_t delay = received - sent - held;
+        //Both ways are taken to be equally long.
+        const int64_t there = static_cast<int64_t>(remoteReceived) - static_cast<int64_t>(sent);
+        const int64_t back = static_cast<int64_t>(remoteSent) - static_cast<int64_t>(received);
+        const int64_t offset = (there + back) / 2;
+        samples[next] = { offset, delay };
+        next = (next + 1) % maxSamples;
+        if (count < maxSamples) {
+            count++;
+        }
+    }
+    
+    int64_t ClockSync::Offset() const {
+        int best = 0;
+        for (int i = 1; i < count; i++) {
+            if (samples[i].delay < samples[best].delay) {
+                best = i;
+            }
+        }
+        return count > 0 ? samples[best].offset : 0;
+    }
+    
+}
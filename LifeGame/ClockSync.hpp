@@ -0,0 +1,41 @@
+//
+//  ClockSync.hpp
+//  LifeGame
+//
+
+#ifndef ClockSync_hpp
+#define ClockSync_hpp
+
+#include <stdint.h>
+
+namespace Messaging {
+
+    //NTP style estimate of the offset between the local clock and a remote one.
+    //The sample with the shortest round trip of the recent ones is trusted, since queuing only adds delay.
+    class ClockSync {
+        struct Sample {
+            int64_t offset;
+            uint64_t delay;
+        };
+        
+        const static int maxSamples = 8;
+        
+        Sample samples[maxSamples];
+        int count;
+        int next;
+        
+    public:
+        explicit ClockSync() : count(0), next(0) {}
+        
+        //All times are in microseconds: sent and received on the local clock, remoteReceived and remoteSent on the remote one.
+        //The time the remote side held the request is not part of the round trip.
+        void AddSample(uint64_t sent, uint64_t remoteReceived, uint64_t remoteSent, uint64_t received);
+        void Reset() { count = 0; next = 0; }
+        bool IsSynchronized() const { return count > 0; }
+        //Remote clock minus local clock.
+        int64_t Offset() const;
+    };
+    
+}
+
+#endif /* ClockSync_hpp */
@@ -6,6 +6,8 @@
 //  Copyright © 2017 Arsonist (gmoximko@icloud.com). All rights reserved.
 //
 
+#include <algorithm>
+#include <limits>
 #include "GameField.hpp"
 #include "Utils.hpp"
 #include "Network.h"
@@ -16,117 +18,231 @@ using namespace Geometry;
 
 namespace Messaging {
 
-    Command::~Command() {}
-
-    std::shared_ptr<Command> Command::Parse(InputMemoryStream &stream) {
-        int32_t cmd;
-        stream.Read(cmd, stream.Size());
-        std::shared_ptr<Command> result;
-        switch (static_cast<Cmd>(cmd)) {
-            case Cmd::Empty:
-                result = std::make_shared<EmptyCommand>();
-                break;
-            case Cmd::AddUnits:
-                result = std::make_shared<AddUnitsCommand>();
-                break;
-            case Cmd::AddPreset:
-                result = std::make_shared<AddPresetCommand>();
-                break;
-            case Cmd::Complex:
-                result = std::make_shared<ComplexCommand>();
-                break;
-            default:
-                Log::Warning("Unknown command has been received!");
-                return nullptr;
-        }
-        result->Read(stream);
-        return result;
+    const size_t Command::reservedUnits = 64;
+    const size_t Command::reservedPresets = 4;
+
+    Command::Command() :
+        empty(true),
+        turnStep(0),
+        checksum(0),
+        unitsId(-1),
+        inputDelay(0) {
+        units.reserve(reservedUnits);
+        presets.reserve(reservedPresets);
     }
 
-    void Command::Read(InputMemoryStream &stream) {
-        int32_t cmd;
-        stream >> cmd >> turnStep >> checksum;
-        if (static_cast<Cmd>(cmd) != Type()) {
-            Log::Error("Commands types are not the same!");
-        }
-        OnRead(stream);
+    void Command::Clear() {
+        empty = true;
+        turnStep = 0;
+        checksum = 0;
+        unitsId = -1;
+        units.clear();
+        presets.clear();
+        inputDelay = 0;
     }
 
-    void Command::Write(OutputMemoryStream &stream) {
-        stream << static_cast<int32_t>(Type()) << turnStep << checksum;
-        OnWrite(stream);
+    void Command::Reset(int32_t turnStep, uint64_t checksum) {
+        Clear();
+        empty = false;
+        this->turnStep = turnStep;
+        this->checksum = checksum;
     }
 
-    void AddUnitsCommand::Apply(GameField *gameField) {
-        for (int i = 0; i < units.size(); i++) {
-            gameField->AddUnit(units[i], id);
-        }
+    void Command::SetUnits(int id, const std::vector<Vector> &units) {
+        unitsId = id;
+        this->units.assign(units.begin(), units.end());
+        auto less = [](const Vector &lhs, const Vector &rhs) { return lhs.y < rhs.y || (lhs.y == rhs.y && lhs.x < rhs.x); };
+        std::sort(this->units.begin(), this->units.end(), less);
+        this->units.erase(std::unique(this->units.begin(), this->units.end()), this->units.end());
     }
 
-    void AddUnitsCommand::OnRead(Network::InputMemoryStream &stream) {
-        int32_t id, size;
-        stream >> id >> size;
-        for (int i = 0; i < size; i++) {
-            int32_t x, y;
-            stream >> x >> y;
-            units.push_back(Vector(static_cast<int>(x), static_cast<int>(y)));
+    void Command::Apply(GameField *gameField) const {
+        if (inputDelay != 0) {
+            gameField->SetInputDelay(inputDelay);
         }
-        this->id = static_cast<int>(id);
+        ApplyUnits(gameField);
     }
-
-    void AddUnitsCommand::OnWrite(Network::OutputMemoryStream &stream) {
-        stream << static_cast<int32_t>(id) << static_cast<int32_t>(units.size());
-        for (int i = 0; i < units.size(); i++) {
-            stream << static_cast<int32_t>(units[i].x) << static_cast<int32_t>(units[i].y);
+    
+    //Presets go first and units last, the order the inputs were issued in before commands became flat.
+    void Command::ApplyUnits(GameField *gameField) const {
+        for (const auto &preset : presets) {
+            gameField->AddPreset(preset.transform, preset.id, preset.preset);
+        }
+        for (const auto &unit : units) {
+            gameField->AddUnit(unit, unitsId);
         }
     }
 
-    void AddPresetCommand::Apply(GameField *gameField) {
-        gameField->AddPreset(trs, id, preset);
-    }
-
-    void AddPresetCommand::OnRead(Network::InputMemoryStream &stream) {
-        uint8_t preset;
-        int32_t id;
-        stream >> preset >> id;
-        this->preset = static_cast<unsigned char>(preset);
-        this->id = static_cast<int>(id);
-        for (int i = 0; i < trs.Size() * trs.Size(); i++) {
-            stream >> trs[i];
+    void Command::Read(InputMemoryStream &stream, Vector fieldSize) {
+        Clear();
+        uint8_t cmd;
+        stream >> cmd;
+        if (static_cast<Cmd>(cmd) == Cmd::Empty) return;
+        if (static_cast<Cmd>(cmd) != Cmd::Complex) {
+            Log::Error("Commands types are not the same!");
+        }
+        empty = false;
+        stream >> turnStep >> checksum;
+        const uint64_t size = stream.ReadVarint();
+        if (size > stream.Remaining()) {
+            throw std::out_of_range("Not enough data!");
+        }
+        for (uint64_t i = 0; i < size; i++) {
+            stream >> cmd;
+            switch (static_cast<Cmd>(cmd)) {
+                case Cmd::AddUnits:
+                    ReadUnits(stream, fieldSize);
+                    break;
+                case Cmd::AddPreset:
+                    ReadPreset(stream);
+                    break;
+                case Cmd::InputDelay:
+                    inputDelay = static_cast<int>(stream.ReadVarint());
+                    break;
+                default:
+                    Log::Error("Unknown command has been recieved!");
+            }
         }
     }
 
-    void AddPresetCommand::OnWrite(Network::OutputMemoryStream &stream) {
-        stream << static_cast<uint8_t>(preset) << static_cast<int32_t>(id);
-        for (int i = 0; i < trs.Size() * trs.Size(); i++) {
-            stream << trs[i];
+    void Command::Write(OutputMemoryStream &stream) const {
+        if (empty) {
+            stream << static_cast<uint8_t>(Cmd::Empty);
+            return;
+        }
+        stream << static_cast<uint8_t>(Cmd::Complex) << turnStep << checksum;
+        stream.WriteVarint(presets.size() + (inputDelay != 0 ? 1 : 0) + (units.empty() ? 0 : 1));
+        for (const auto &preset : presets) {
+            stream << static_cast<uint8_t>(Cmd::AddPreset);
+            WritePreset(stream, preset);
+        }
+        if (inputDelay != 0) {
+            stream << static_cast<uint8_t>(Cmd::InputDelay);
+            stream.WriteVarint(static_cast<uint64_t>(inputDelay));
+        }
+        if (!units.empty()) {
+            stream << static_cast<uint8_t>(Cmd::AddUnits);
+            WriteUnits(stream);
         }
     }
 
-    void ComplexCommand::Apply(GameField *gameField) {
-        for (int i = 0; i < commands.size(); i++) {
-            commands[i]->Apply(gameField);
+    //Units are sent as indices inside their bounding box, either delta coded or as a bitmap for dense shapes.
+    void Command::ReadUnits(Network::InputMemoryStream &stream, Vector fieldSize) {
+        const uint64_t id = stream.ReadVarint();
+        const uint64_t count = stream.ReadVarint();
+        if (id >= GameField::maxPlayers) {
+            throw std::out_of_range("Wrong player of units!");
+        }
+        if (count > 8ull * stream.Remaining()) {
+            throw std::out_of_range("Not enough data!");
+        }
+        if (!units.empty() && static_cast<int>(id) != unitsId) {
+            throw std::invalid_argument("Units of different players in one command!");
+        }
+        unitsId = static_cast<int>(id);
+        if (count == 0) return;
+        const size_t first = units.size();
+        const int64_t minX = stream.ReadSignedVarint();
+        const int64_t minY = stream.ReadSignedVarint();
+        const uint64_t width = stream.ReadVarint() + 1;
+        const uint64_t height = stream.ReadVarint() + 1;
+        if (width > std::numeric_limits<int32_t>::max() || height > std::numeric_limits<int32_t>::max()) {
+            throw std::out_of_range("Units bounds are too large!");
+        }
+        //Every decoded unit lies inside its bounding box, so checking the box keeps them all on the field.
+        if (minX < 0 || minY < 0 || minX + static_cast<int64_t>(width) > fieldSize.x || minY + static_cast<int64_t>(height) > fieldSize.y) {
+            throw std::out_of_range("Units are out of the field!");
+        }
+        uint8_t encoding;
+        stream >> encoding;
+        units.reserve(first + count);
+        if (static_cast<Encoding>(encoding) == Encoding::Bitmap) {
+            const uint64_t bytesCount = (width * height + 7) / 8;
+            if (bytesCount > stream.Remaining()) {
+                throw std::out_of_range("Not enough data!");
+            }
+            const uint8_t *bitmap = stream.ReadBytes(static_cast<uint32_t>(bytesCount));
+            for (uint64_t index = 0; index < width * height; index++) {
+                if ((bitmap[index >> 3] & (1 << (index & 7))) == 0) continue;
+                units.push_back(Vector(static_cast<int>(minX + index % width), static_cast<int>(minY + index / width)));
+            }
+            if (units.size() - first != count) {
+                throw std::out_of_range("Units bitmap does not match units count!");
+            }
+        } else {
+            uint64_t index = 0;
+            for (uint64_t i = 0; i < count; i++) {
+                const uint64_t delta = stream.ReadVarint();
+                index = i == 0 ? delta : index + delta + 1;
+                if (index / width >= height) {
+                    throw std::out_of_range("Unit is out of its bounds!");
+                }
+                units.push_back(Vector(static_cast<int>(minX + index % width), static_cast<int>(minY + index / width)));
+            }
         }
     }
 
-    void ComplexCommand::OnRead(Network::InputMemoryStream &stream) {
-        int32_t size;
-        stream >> size;
-        for (int32_t i = 0; i < size; i++) {
-            std::shared_ptr<Command> command = Command::Parse(stream);
-            if (command == nullptr) {
-                Log::Error("Unknown command has been recieved!");
-            } else {
-                commands.push_back(command);
+    void Command::WriteUnits(Network::OutputMemoryStream &stream) const {
+        stream.WriteVarint(static_cast<uint64_t>(unitsId));
+        stream.WriteVarint(units.size());
+        if (units.empty()) return;
+        Vector min = units.front();
+        Vector max = units.back();
+        for (const auto &unit : units) {
+            min.x = std::min(min.x, unit.x);
+            max.x = std::max(max.x, unit.x);
+        }
+        const uint64_t width = static_cast<uint64_t>(max.x - min.x) + 1;
+        const uint64_t height = static_cast<uint64_t>(max.y - min.y) + 1;
+        auto indexOf = [&](const Vector &unit) {
+            return static_cast<uint64_t>(unit.y - min.y) * width + static_cast<uint64_t>(unit.x - min.x);
+        };
+        uint64_t deltasSize = 0;
+        for (size_t i = 0; i < units.size(); i++) {
+            deltasSize += OutputMemoryStream::VarintSize(i == 0 ? indexOf(units[i]) : indexOf(units[i]) - indexOf(units[i - 1]) - 1);
+        }
+        const uint64_t bitmapSize = (width * height + 7) / 8;
+        const Encoding encoding = bitmapSize < deltasSize ? Encoding::Bitmap : Encoding::Deltas;
+        stream.WriteSignedVarint(min.x);
+        stream.WriteSignedVarint(min.y);
+        stream.WriteVarint(width - 1);
+        stream.WriteVarint(height - 1);
+        stream << static_cast<uint8_t>(encoding);
+        if (encoding == Encoding::Bitmap) {
+            //The bitmap is built in place inside the stream.
+            const uint32_t offset = stream.Size();
+            stream.Resize(offset + static_cast<uint32_t>(bitmapSize));
+            uint8_t *bitmap = static_cast<uint8_t *>(stream.Data(offset));
+            std::fill(bitmap, bitmap + bitmapSize, 0);
+            for (const auto &unit : units) {
+                const uint64_t index = indexOf(unit);
+                bitmap[index >> 3] |= static_cast<uint8_t>(1 << (index & 7));
+            }
+        } else {
+            for (size_t i = 0; i < units.size(); i++) {
+                stream.WriteVarint(i == 0 ? indexOf(units[i]) : indexOf(units[i]) - indexOf(units[i - 1]) - 1);
             }
         }
     }
 
-    void ComplexCommand::OnWrite(Network::OutputMemoryStream &stream) {
-        stream << static_cast<int32_t>(commands.size());
-        for (int i = 0; i < commands.size(); i++) {
-            commands[i]->Write(stream);
+    void Command::ReadPreset(Network::InputMemoryStream &stream) {
+        uint8_t preset, orientation;
+        stream >> preset >> orientation;
+        const uint64_t id = stream.ReadVarint();
+        const int64_t x = stream.ReadSignedVarint();
+        const int64_t y = stream.ReadSignedVarint();
+        if (id >= GameField::maxPlayers) {
+            throw std::out_of_range("Wrong player of preset!");
         }
+        presets.push_back({ Transform(orientation, Vector(static_cast<int>(x), static_cast<int>(y))), static_cast<unsigned char>(preset), static_cast<int>(id) });
+    }
+
+    void Command::WritePreset(Network::OutputMemoryStream &stream, const Preset &preset) const {
+        const Vector translation = preset.transform.GetTranslation();
+        stream << static_cast<uint8_t>(preset.preset) << preset.transform.Orientation();
+        stream.WriteVarint(static_cast<uint64_t>(preset.id));
+        stream.WriteSignedVarint(translation.x);
+        stream.WriteSignedVarint(translation.y);
     }
 
 }
@@ -12,97 +12,78 @@
 #include <vector>
 #include <memory>
 #include "Utils.hpp"
+#include "Geometry.h"
+#include "Network.h"
 
 namespace Messaging {
 
+    //Everything one player issues for one turn, kept in a flat record.
+    //Clearing a command keeps its storage, and a new record already has room for a usual turn,
+    //so recycled records only allocate for an unusually large input.
+    //On the wire it is a complex command with a sub command per kind of input.
     class Command {
-        int32_t turnStep;
-        uint64_t checksum;
-        
-    public:
-        enum class Cmd {
+        enum class Cmd : uint8_t {
             Empty,
             AddUnits,
             AddPreset,
-            Complex
+            Complex,
+            InputDelay
         };
-        
-        static std::shared_ptr<Command> Parse(Network::InputMemoryStream &stream);
-        
-        explicit Command(int32_t turnStep = 0, uint64_t checksum = 0) : turnStep(turnStep), checksum(checksum) {}
-        virtual ~Command() = 0;
-        virtual Cmd Type() = 0;
-        virtual void Apply(class GameField *gameField) = 0;
-        
-        void Read(Network::InputMemoryStream &stream);
-        void Write(Network::OutputMemoryStream &stream);
-        int32_t TurnStep() const { return turnStep; }
-        uint64_t Checksum() const { return checksum; }
-        
-    private:
-        virtual void OnRead(Network::InputMemoryStream &stream) = 0;
-        virtual void OnWrite(Network::OutputMemoryStream &stream) = 0;
-    };
 
-    class EmptyCommand : public Command {
-    public:
-        virtual ~EmptyCommand() override {}
-        virtual Cmd Type() override { return Cmd::Empty; }
-        virtual void Apply(class GameField *gameField) override {}
-        
-    private:
-        virtual void OnRead(Network::InputMemoryStream &stream) override {}
-        virtual void OnWrite(Network::OutputMemoryStream &stream) override {}
-    };
+        enum class Encoding : uint8_t {
+            Deltas,
+            Bitmap
+        };
 
-    class AddUnitsCommand : public Command {
-        int id;
-        std::vector<Geometry::Vector> units;
-        
     public:
-        explicit AddUnitsCommand() : id(-1) {}
-        explicit AddUnitsCommand(int id, std::vector<Geometry::Vector> units) : id(id), units(std::move(units)) {}
-        virtual ~AddUnitsCommand() override {}
-        virtual Cmd Type() override { return Cmd::AddUnits; }
-        virtual void Apply(class GameField *gameField) override;
-        
-    private:
-        virtual void OnRead(Network::InputMemoryStream &stream) override;
-        virtual void OnWrite(Network::OutputMemoryStream &stream) override;
-    };
+        struct Preset {
+            Geometry::Transform transform;
+            unsigned char preset;
+            int id;
+        };
 
-    class AddPresetCommand : public Command {
-        Geometry::Matrix3x3 trs;
-        unsigned char preset;
-        int id;
-        
-    public:
-        explicit AddPresetCommand() {}
-        explicit AddPresetCommand(Geometry::Matrix3x3 trs, unsigned char preset, int id) : trs(trs), preset(preset), id(id) {}
-        virtual ~AddPresetCommand() override {}
-        virtual Cmd Type() override { return Cmd::AddPreset; }
-        virtual void Apply(class GameField *gameField) override;
-        
     private:
-        virtual void OnRead(Network::InputMemoryStream &stream) override;
-        virtual void OnWrite(Network::OutputMemoryStream &stream) override;
-    };
-
-    class ComplexCommand : public Command {
-        std::vector<std::shared_ptr<Command>> commands;
+        static const size_t reservedUnits;
+        static const size_t reservedPresets;
         
+        //Empty commands fill the queues at the start and when the input delay grows; they carry no turn data.
+        bool empty;
+        int32_t turnStep;
+        uint64_t checksum;
+        int unitsId;
+        std::vector<Geometry::Vector> units;
+        std::vector<Preset> presets;
+        int inputDelay;
+
     public:
-        explicit ComplexCommand() {}
-        explicit ComplexCommand(int32_t turnStep, uint64_t checksum, std::vector<std::shared_ptr<Command>> commands) :
-            Command(turnStep, checksum), commands(std::move(commands)) {}
-        virtual ~ComplexCommand() override {}
-        virtual Cmd Type() override { return Cmd::Complex; }
-        virtual void Apply(class GameField *gameField) override;
-        
+        explicit Command();
+        Command(const Command &other) = delete;
+        Command &operator = (const Command &other) = delete;
+
+        void Clear();
+        void Reset(int32_t turnStep, uint64_t checksum);
+        void AddPreset(const Preset &preset) { presets.push_back(preset); }
+        //Units are sorted and deduplicated, so the sender applies them in the same order as receivers decode them.
+        void SetUnits(int id, const std::vector<Geometry::Vector> &units);
+        //Changes how many turns ahead commands are scheduled; applied on every peer at the same turn.
+        void SetInputDelay(int turns) { inputDelay = turns; }
+        void Apply(class GameField *gameField) const;
+        //Applies only the changes to the field, which is what a predicted turn replays.
+        void ApplyUnits(class GameField *gameField) const;
+        bool ChangesField() const { return !presets.empty() || !units.empty(); }
+
+        //Units outside a field of fieldSize are rejected, as they would index past the field's tiles and bitmaps.
+        void Read(Network::InputMemoryStream &stream, Geometry::Vector fieldSize);
+        void Write(Network::OutputMemoryStream &stream) const;
+        int32_t TurnStep() const { return turnStep; }
+        uint64_t Checksum() const { return checksum; }
+
     private:
-        virtual void OnRead(Network::InputMemoryStream &stream) override;
-        virtual void OnWrite(Network::OutputMemoryStream &stream) override;
+        void ReadUnits(Network::InputMemoryStream &stream, Geometry::Vector fieldSize);
+        void WriteUnits(Network::OutputMemoryStream &stream) const;
+        void ReadPreset(Network::InputMemoryStream &stream);
+        void WritePreset(Network::OutputMemoryStream &stream, const Preset &preset) const;
     };
-    
+
 }
 #endif /* Command_hpp */
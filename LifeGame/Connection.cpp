@@ -7,6 +7,7 @@
 //
 
 #include <algorithm>
+#include "Utils.hpp"
 #include "Connection.hpp"
 
 using namespace Network;
@@ -14,49 +15,123 @@ using namespace Network;
 namespace Messaging {
 
     Connection::Connection(TCPSocketPtr socket) :
-        canRead(true),
-        canWrite(true),
-        input(1024),
-        output(1024),
-        recvMessages(0),
-        recvData(0),
-        allRecvData(0),
+        pending(false),
+        closing(false),
         sendData(0),
+        messageSize(0),
+        recvBuffer(1024),
+        sendHead(0),
+        queued(0),
         socket(socket) {
         socket->NagleAlgorithm(false);
     }
 
     int Connection::Recv() {
-        uint32_t dataSize = socket->DataSize();
-        if (input.Capacity() - recvData < dataSize) {
-            input.Realloc(std::max(input.Capacity() * 2, dataSize));
-        }
-        int result = socket->Recv(input.Data(recvData), input.Capacity() - recvData);
-        recvData += result;
-        
-        while (allRecvData < recvData) {
-            uint32_t msgSize;
-            input.Read(msgSize, allRecvData);
-            allRecvData += msgSize;
-            recvMessages++;
-        }
-        
-        canRead = recvData == allRecvData;
-        if (canRead) {
-            recvData = 0;
-            allRecvData = 0;
+        //Grows only once full, which also keeps room for the zero-length read that reports a closed socket.
+        if (recvBuffer.Writable() == 0) {
+            recvBuffer.Reserve(recvBuffer.Capacity());
+        }
+        IOBuffer buffers[2];
+        const int count = recvBuffer.WriteSegments(buffers);
+        const int result = socket->Recv(buffers, count);
+        if (result > 0) {
+            recvBuffer.Commit(static_cast<uint32_t>(result));
         }
         return result;
     }
 
+    void Connection::Close() {
+        //Messages posted right before the close go out as far as the socket takes them.
+        Send();
+        closing = true;
+        socket->Shutdown();
+        //Whatever is still queued can not go out any more.
+        queued -= static_cast<uint32_t>(sendQueue.size() - sendHead);
+        sendQueue.clear();
+        sendHead = 0;
+        sendData = 0;
+    }
+
+    void Connection::Enqueue(Buffer buffer) {
+        if (closing) {
+            queued--;
+            return;
+        }
+        sendQueue.push_back(buffer);
+    }
+
     int Connection::Send() {
-        int result = socket->Send(output.Data(sendData), output.Size() - sendData);
-        sendData += result;
-        canWrite = sendData == output.Size();
-        if (canWrite) {
-            sendData = 0;
+        if (CanWrite()) return 0;
+        IOBuffer buffers[maxSendBuffers];
+        int count = 0;
+        uint32_t offset = sendData;
+        for (size_t i = sendHead; i < sendQueue.size() && count < maxSendBuffers; i++) {
+            buffers[count].data = sendQueue[i]->Data(offset);
+            buffers[count].size = sendQueue[i]->Size() - offset;
+            offset = 0;
+            count++;
+        }
+        const int result = socket->Send(buffers, count);
+        uint32_t sent = static_cast<uint32_t>(result) + sendData;
+        while (sendHead < sendQueue.size() && sent >= sendQueue[sendHead]->Size()) {
+            sent -= sendQueue[sendHead]->Size();
+            sendQueue[sendHead++].reset();
+            queued--;
+        }
+        sendData = sent;
+        if (CanWrite()) {
+            sendQueue.clear();
+            sendHead = 0;
+        } else if (sendHead > sendQueue.size() / 2) {
+            sendQueue.erase(sendQueue.begin(), sendQueue.begin() + sendHead);
+            sendHead = 0;
         }
         return result;
     }
-    
+
+    bool Connection::CanRead() const {
+        const uint32_t readable = recvBuffer.Readable() - messageSize;
+        if (readable < sizeof(uint32_t)) return false;
+        uint32_t size;
+        recvBuffer.Peek(&size, sizeof(size), messageSize);
+        return readable >= WireOrder(size);
+    }
+
+    bool Connection::NextMessage() {
+        recvBuffer.Consume(messageSize);
+        messageSize = 0;
+        input.Wrap(nullptr, 0);
+        if (!CanRead()) return false;
+        uint32_t size;
+        recvBuffer.Peek(&size, sizeof(size));
+        size = WireOrder(size);
+        if (size < sizeof(uint32_t)) {
+            Log::Error("Connection::NextMessage broken message size!");
+        }
+        const uint8_t *data = recvBuffer.Contiguous(size);
+        if (data == nullptr) {
+            wrappedMessage.resize(size);
+            recvBuffer.Peek(wrappedMessage.data(), size);
+            data = wrappedMessage.data();
+        }
+        input.Wrap(data, size);
+        messageSize = size;
+        return true;
+    }
+
+    bool Connection::PopMessage(std::vector<uint8_t> &message) {
+        if (!CanRead()) return false;
+        uint32_t size;
+        recvBuffer.Peek(&size, sizeof(size), messageSize);
+        size = WireOrder(size);
+        if (size < sizeof(uint32_t)) {
+            Log::Error("Connection::PopMessage broken message size!");
+        }
+        message.resize(size);
+        recvBuffer.Peek(message.data(), size, messageSize);
+        recvBuffer.Consume(messageSize + size);
+        messageSize = 0;
+        return true;
+    }
+
 }
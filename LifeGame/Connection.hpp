@@ -9,33 +9,56 @@
 #ifndef Connection_hpp
 #define Connection_hpp
 
+#include <vector>
+#include <atomic>
 #include "Network.h"
+#include "RingBuffer.hpp"
 
 namespace Messaging {
 
     class Connection {
-        bool canRead;
-        bool canWrite;
-        uint32_t recvMessages;
-        uint32_t recvData;
-        uint32_t allRecvData;
+        friend class Messenger;
+        typedef std::shared_ptr<const Network::OutputMemoryStream> Buffer;
+        //Upper bound of buffers handed to a single gather write.
+        const static int maxSendBuffers = 16;
+        
+        bool pending;
+        //Set once this side shut the socket down; nothing can be written after that.
+        bool closing;
         uint32_t sendData;
+        uint32_t messageSize;
+        Network::RingBuffer recvBuffer;
+        std::vector<uint8_t> wrappedMessage;
+        //Serialized messages are shared between connections, so a broadcast is encoded once.
+        //Sent entries are skipped by sendHead and dropped in bulk, so the vector keeps its storage.
+        std::vector<Buffer> sendQueue;
+        size_t sendHead;
+        //Messages handed to Messenger::Send and not written yet; counted on both sides of the I/O thread.
+        std::atomic<uint32_t> queued;
         
     public:
         Network::TCPSocketPtr socket;
+        //View of the message returned by the last NextMessage call.
         Network::InputMemoryStream input;
-        Network::OutputMemoryStream output;
         
         explicit Connection(Network::TCPSocketPtr socket);
         
-        uint32_t RecvMessages() const { return recvMessages; }
-        bool CanRead() const { return canRead; }
-        bool CanWrite() const { return canWrite; }
-        void Clear() { recvMessages = 0; }
-        void Close() { socket->Shutdown(); }
+        bool CanRead() const;
+        bool CanWrite() const { return sendHead == sendQueue.size(); }
+        //Lets the owner notice a peer that does not keep up without looking into the send queue.
+        uint32_t Queued() const { return queued; }
+        void Close();
         
+        void Enqueue(Buffer buffer);
+        //Reads what fits into the free space of the receive buffer; returns -1 if nothing has arrived and 0 once closed.
         int Recv();
+        //Writes as much of the queue as the socket accepts with one gather write.
         int Send();
+        //Releases the previous message and points input at the next complete one, if any.
+        //The message is read in place unless it wraps around the end of the receive buffer.
+        bool NextMessage();
+        //Copies the next complete message out of the receive buffer, so it can be read on another thread.
+        bool PopMessage(std::vector<uint8_t> &message);
     };
 
     typedef std::shared_ptr<Connection> ConnectionPtr;
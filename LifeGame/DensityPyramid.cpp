@@ -0,0 +1,117 @@
+//
+//  DensityPyramid.cpp
+//  LifeGame
+//
+
+#include <algorithm>
+#include <cassert>
+#include "DensityPyramid.hpp"
+#include "GameField.hpp"
+
+using namespace Geometry;
+
+const int DensityPyramid::players = 8;
+//Counting all 64 players apart would make every block eight times larger for colors nobody tells apart.
+static_assert(DensityPyramid::players <= GameField::maxPlayers, "Density slots have to map to player ids!");
+
+DensityPyramid::DensityPyramid() {}
+
+int DensityPyramid::MaxShift(Vector size) {
+    int shift = 1;
+    while ((1 << shift) < std::max(size.x, size.y)) shift++;
+    return shift;
+}
+
+const DensityPyramid::Level &DensityPyramid::Update(const TileIndex &index, int shift) {
+    if (size != index.GetSize()) {
+        Reset(index.GetSize());
+    }
+    shift = std::max(1, std::min(shift, static_cast<int>(levels.size())));
+    Level &level = levels[shift - 1];
+    const int tileShift = TileIndex::TileShift();
+    if (shift <= tileShift) {
+        BuildFromTiles(index, level);
+    } else {
+        BuildFromLevel(index, Update(index, tileShift), level);
+    }
+    return level;
+}
+
+void DensityPyramid::Reset(Vector size) {
+    this->size = size;
+    levels.clear();
+    levels.resize(MaxShift(size));
+    for (size_t i = 0; i < levels.size(); i++) {
+        Level &level = levels[i];
+        level.shift = static_cast<int>(i) + 1;
+        level.size = Vector(((size.x - 1) >> level.shift) + 1, ((size.y - 1) >> level.shift) + 1);
+        level.built = false;
+    }
+}
+
+void DensityPyramid::BuildFromTiles(const TileIndex &index, Level &level) {
+    if (!level.built) {
+        level.counts.assign(level.size.x * level.size.y * players, 0);
+        level.tileStamps.assign(index.TilesCount().x * index.TilesCount().y, 0);
+    }
+    const int blocksPerTile = TileIndex::TileSize() >> level.shift;
+    const Vector tiles = index.TilesCount();
+    for (int ty = 0; ty < tiles.y; ty++) {
+        for (int tx = 0; tx < tiles.x; tx++) {
+            const uint32_t stamp = index.GetStamp(tx, ty);
+            uint32_t &built = level.tileStamps[ty * tiles.x + tx];
+            if (level.built && built == stamp) continue;
+            built = stamp;
+            const int maxX = std::min((tx + 1) * blocksPerTile, level.size.x);
+            const int maxY = std::min((ty + 1) * blocksPerTile, level.size.y);
+            for (int y = ty * blocksPerTile; y < maxY; y++) {
+                uint32_t *row = &level.counts[(y * level.size.x + tx * blocksPerTile) * players];
+                std::fill(row, row + (maxX - tx * blocksPerTile) * players, 0);
+            }
+            for (const auto &unit : index.GetTile(tx, ty)) {
+                const int x = unit.position.x >> level.shift;
+                const int y = unit.position.y >> level.shift;
+                level.counts[(y * level.size.x + x) * players + std::min(unit.player, players - 1)]++;
+            }
+        }
+    }
+    level.built = true;
+}
+
+void DensityPyramid::BuildFromLevel(const TileIndex &index, const Level &from, Level &level) {
+    //From is the tile level, so each of its blocks is exactly one tile.
+    assert(from.shift == TileIndex::TileShift() && level.shift > from.shift);
+    const int ratio = level.shift - from.shift;
+    const Vector tiles = index.TilesCount();
+    if (!level.built) {
+        level.counts.assign(level.size.x * level.size.y * players, 0);
+        level.tileStamps.assign(tiles.x * tiles.y, 0);
+    }
+    for (int by = 0; by < level.size.y; by++) {
+        for (int bx = 0; bx < level.size.x; bx++) {
+            const int minX = bx << ratio, maxX = std::min((bx + 1) << ratio, tiles.x);
+            const int minY = by << ratio, maxY = std::min((by + 1) << ratio, tiles.y);
+            bool changed = !level.built;
+            for (int ty = minY; ty < maxY; ty++) {
+                for (int tx = minX; tx < maxX; tx++) {
+                    const uint32_t stamp = index.GetStamp(tx, ty);
+                    uint32_t &built = level.tileStamps[ty * tiles.x + tx];
+                    changed |= built != stamp;
+                    built = stamp;
+                }
+            }
+            if (!changed) continue;
+            uint32_t *target = &level.counts[(by * level.size.x + bx) * players];
+            std::fill(target, target + players, 0);
+            for (int ty = minY; ty < maxY; ty++) {
+                for (int tx = minX; tx < maxX; tx++) {
+                    const uint32_t *block = from.Block(tx, ty);
+                    for (int i = 0; i < players; i++) {
+                        target[i] += block[i];
+                    }
+                }
+            }
+        }
+    }
+    level.built = true;
+}
@@ -0,0 +1,48 @@
+//
+//  DensityPyramid.hpp
+//  LifeGame
+//
+
+#ifndef DensityPyramid_hpp
+#define DensityPyramid_hpp
+
+#include <vector>
+#include <stdint.h>
+#include "TileIndex.hpp"
+
+//Per-player population counts over square blocks of 2^shift cells, one level per shift.
+//Levels are built on demand and refreshed only for tiles whose stamp changed since the last request;
+//levels coarser than a tile re-sum only the blocks covering such tiles.
+class DensityPyramid {
+public:
+    struct Level {
+        int shift;
+        Geometry::Vector size;
+        std::vector<uint32_t> counts;
+        std::vector<uint32_t> tileStamps;
+        bool built;
+        
+        const uint32_t *Block(int x, int y) const { return &counts[(y * size.x + x) * players]; }
+    };
+    
+    //Players counted apart; higher ids share the last slot, as they share the last color when drawn.
+    static const int players;
+    
+private:
+    std::vector<Level> levels;
+    Geometry::Vector size;
+    
+public:
+    explicit DensityPyramid();
+    
+    static int MaxShift(Geometry::Vector size);
+    
+    const Level &Update(const TileIndex &index, int shift);
+    
+private:
+    void Reset(Geometry::Vector size);
+    void BuildFromTiles(const TileIndex &index, Level &level);
+    void BuildFromLevel(const TileIndex &index, const Level &from, Level &level);
+};
+
+#endif /* DensityPyramid_hpp */
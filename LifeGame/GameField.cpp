@@ -8,22 +8,43 @@
 
 #include <cstdlib>
 #include <cassert>
+#include <algorithm>
 #include "GameField.hpp"
 #include "Peer.hpp"
 #include "Presets.hpp"
+#include "Simulation.hpp"
 
 using namespace Geometry;
 
+//SplitMix64 finalizer: every input bit affects every output bit.
+static uint64_t Mix(uint64_t value) {
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+    return value ^ (value >> 31);
+}
+
+static uint64_t Hash(uint32_t seed, uint32_t generation, const Vector &cell) {
+    const uint64_t position = (static_cast<uint64_t>(static_cast<uint32_t>(cell.x)) << 32) | static_cast<uint32_t>(cell.y);
+    return Mix(Mix((static_cast<uint64_t>(seed) << 32) | generation) ^ position);
+}
+
 GameField::GameField(std::shared_ptr<Presets> presets) : GameField(presets, Vector(), 0, -1) {}
 
 GameField::GameField(std::shared_ptr<Presets> presets, Vector size, unsigned turnTime, int player) :
+    peer(nullptr),
     presets(presets),
+    units(new std::unordered_set<Unit>()),
+    size(size),
     player(player),
     exit(false),
+    enemyZoneDirty(true),
+    enemyZone(distanceToEnemy),
     turnTime(turnTime),
-    currentPreset(-1),
-    size(size),
-    units(new std::unordered_set<Unit>()) {}
+    generation(0),
+    seed(0),
+    next(new std::unordered_set<Unit>()),
+    speculatedUnits(nullptr),
+    speculatedGeneration(0) {}
 
 void GameField::ClampVector(Vector &vec) const {
     vec.x %= size.x;
@@ -33,138 +54,291 @@ void GameField::ClampVector(Vector &vec) const {
 }
 
 void GameField::ProcessUnits() {
-    std::unordered_map<Vector, uint32_t> processCells;
-    processCells.reserve(units->size() * 9);
+    if (IsSpeculated()) {
+        Patch(*units, *next);
+    } else {
+        Step(*units, *next);
+    }
+    units.swap(next);
+    speculatedUnits = nullptr;
+    enemyZoneDirty = true;
+    generation++;
+}
+
+void GameField::Speculate() {
+    if (IsSpeculated()) return;
+    Step(*units, *next);
+    speculatedUnits = units.get();
+    speculatedGeneration = generation;
+    touched.clear();
+}
+
+void GameField::Step(const std::unordered_set<Unit> &units, std::unordered_set<Unit> &result) {
+    std::unordered_map<Vector, Neighbourhood> processCells;
+    processCells.reserve(units.size() * 9);
     const size_t bucketCount = processCells.bucket_count();
-    for (const auto &unit : *units) {
+    for (const auto &unit : units) {
         ProcessUnit(unit, processCells);
     }
     assert(bucketCount == processCells.bucket_count());
     
-    units->clear();
-    const uint32_t oneOneOne = 7;
-    for (const auto &cell : processCells) {
-        const uint32_t cellMask = cell.second;
-        uint32_t offset = 0;
-        uint32_t maxNeighbours = 0;
-        uint32_t self = 0;
-        for (int i = 0; i < maxPlayers; i++) {
-            uint32_t neighbours = cellMask & (oneOneOne << 4 * i);
-            neighbours >>= 4 * i;
-            if (neighbours > maxNeighbours || (neighbours == maxNeighbours && Random::NextBool())) {
-                maxNeighbours = neighbours;
-                offset = i;
-                self = cellMask & (1 << (4 * (i + 1) - 1));
+    result.clear();
+    for (auto &cell : processCells) {
+        int owner = 0;
+        if (Resolve(cell.first, cell.second, owner)) {
+            result.emplace(owner, cell.first);
+        }
+    }
+}
+
+void GameField::Patch(const std::unordered_set<Unit> &units, std::unordered_set<Unit> &result) {
+    //A unit only counts for the eight cells around it, so nothing else can differ from the speculated generation.
+    patchCells.clear();
+    for (const Vector &unit : touched) {
+        for (int x = -1; x <= 1; x++) {
+            for (int y = -1; y <= 1; y++) {
+                Vector pos = unit + Vector(x, y);
+                ClampVector(pos);
+                patchCells.insert(pos);
             }
         }
-        assert(offset >= 0 && offset <= 7);
-        assert(maxNeighbours >= 0 && maxNeighbours <= 7);
-        if (maxNeighbours == 3 || (maxNeighbours == 2 && self != 0)) {
-            units->emplace(offset, cell.first);
+    }
+    touched.clear();
+    for (const Vector &cell : patchCells) {
+        //Gathered the way ProcessUnit spreads units, including the wrap on very narrow fields.
+        Neighbourhood neighbourhood;
+        for (int x = -1; x <= 1; x++) {
+            for (int y = -1; y <= 1; y++) {
+                Vector pos = cell - Vector(x, y);
+                ClampVector(pos);
+                auto unit = units.find(Unit(0, pos));
+                if (unit == units.end()) continue;
+                if (x == 0 && y == 0) {
+                    neighbourhood.self = static_cast<uint8_t>(unit->player + 1);
+                } else if (neighbourhood.count < 8) {
+                    neighbourhood.players[neighbourhood.count++] = static_cast<uint8_t>(unit->player);
+                }
+            }
+        }
+        result.erase(Unit(0, cell));
+        int owner = 0;
+        if (Resolve(cell, neighbourhood, owner)) {
+            result.emplace(owner, cell);
         }
     }
 }
 
-void GameField::ProcessUnit(const Unit &unit, std::unordered_map<Vector, uint32_t> &processCells) {
-    const uint32_t player = 1 << (4 * (unit.player + 1) - 1);
-    const uint32_t offset = 4 * unit.player;
-    const uint32_t oneOneOne = 7;
-    
+bool GameField::Resolve(const Vector &cell, Neighbourhood &neighbourhood, int &owner) const {
+    //The owner needs two neighbours to keep a cell and three to take one.
+    if (neighbourhood.count < 2) return false;
+    //Sorted, and ties are decided by the cell itself, so the result does not depend on the order cells are visited in.
+    std::sort(neighbourhood.players, neighbourhood.players + neighbourhood.count);
+    const uint64_t ties = Hash(seed, generation, cell);
+    int tie = 0;
+    uint32_t maxNeighbours = 0;
+    for (int i = 0; i < neighbourhood.count;) {
+        int next = i + 1;
+        while (next < neighbourhood.count && neighbourhood.players[next] == neighbourhood.players[i]) {
+            next++;
+        }
+        const uint32_t neighbours = static_cast<uint32_t>(next - i);
+        if (neighbours > maxNeighbours || (neighbours == maxNeighbours && ((ties >> tie++) & 1))) {
+            maxNeighbours = neighbours;
+            owner = neighbourhood.players[i];
+        }
+        i = next;
+    }
+    const bool self = neighbourhood.self == owner + 1;
+    return maxNeighbours == 3 || (maxNeighbours == 2 && self);
+}
+
+void GameField::ProcessUnit(const Unit &unit, std::unordered_map<Vector, Neighbourhood> &processCells) {
+    assert(unit.player >= 0 && unit.player < maxPlayers);
     for (int x = -1; x <= 1; x++) {
         for (int y = -1; y <= 1; y++) {
             Vector pos = unit.position + Vector(x, y);
             ClampVector(pos);
-            auto insertion = processCells.emplace(pos, 0);
+            Neighbourhood &cell = processCells[pos];
             
             if (x == 0 && y == 0) {
-                insertion.first->second |= player;
-            } else {
-                uint32_t &cell = insertion.first->second;
-                uint32_t neighbours = cell & (oneOneOne << offset);
-                neighbours >>= offset;
-                neighbours = (neighbours + 1) & oneOneOne;
-                assert(neighbours >= 0 && neighbours <= 7);
-                cell &= ~(oneOneOne << offset);
-                cell |= neighbours << offset;
+                cell.self = static_cast<uint8_t>(unit.player + 1);
+            } else if (cell.count < 8) {
+                //Only fields narrower than three cells wrap a unit onto the same cell more than once.
+                cell.players[cell.count++] = static_cast<uint8_t>(unit.player);
             }
         }
     }
 }
 
-void GameField::AddPreset(const Matrix3x3 &matrix) {
+void GameField::AddPreset(const Transform &transform, unsigned char preset) {
     if (IsGameStopped()) return;
-    const std::shared_ptr<std::vector<Vector>> loadedUnits = presets->Load(currentPreset);
-    for (const auto &unit : *loadedUnits) {
-        Vector vec = matrix * unit;
-        ClampVector(vec);
-        if (!CanInsert(vec)) return;
+    const std::shared_ptr<std::vector<Vector>> loadedUnits = presets->Load(preset);
+    if (loadedUnits == nullptr) return;
+    TransformPreset(transform, *loadedUnits);
+    UpdateEnemyZone();
+    for (const auto &unit : presetCells) {
+        if (!CanInsert(unit)) return;
     }
-    peer->AddPreset(matrix, currentPreset);
+    peer->AddPreset(transform, preset);
 }
 
-void GameField::AddPreset(const Matrix3x3 &matrix, int id, unsigned char preset) {
+void GameField::AddPreset(const Transform &transform, int id, unsigned char preset) {
     std::shared_ptr<std::vector<Vector>> loadedUnits = presets->Load(preset);
     assert(loadedUnits != nullptr);
-    for (int i = 0; i < loadedUnits->size(); i++) {
-        Vector pos = matrix * loadedUnits->at(i);
-        ClampVector(pos);
-        AddUnit(pos, id);
+    TransformPreset(transform, *loadedUnits);
+    for (const auto &unit : presetCells) {
+        AddUnit(unit, id);
+    }
+}
+
+void GameField::TransformPreset(const Transform &transform, const std::vector<Vector> &preset) {
+    presetCells.resize(preset.size());
+    transform.Apply(preset.data(), presetCells.data(), preset.size());
+    for (auto &unit : presetCells) {
+        ClampVector(unit);
     }
 }
 
 void GameField::AddUnit(Vector unit) {
     if (IsGameStopped()) return;
+    //Receivers reject units outside the field, so they are wrapped before being sent.
+    ClampVector(unit);
     const Unit key(player, unit);
+    UpdateEnemyZone();
     if (units->find(key) == units->end() && CanInsert(unit)) {
         peer->AddUnit(unit);
     }
 }
 
 bool GameField::AddUnit(Vector unit, int id) {
-    return units->emplace(id, unit).second;
+    //The enemy bitmap and the tiles index rows by position, so nothing outside the field gets in.
+    ClampVector(unit);
+    const bool inserted = units->emplace(id, unit).second;
+    if (!inserted) return false;
+    if (IsSpeculated()) {
+        touched.push_back(unit);
+    }
+    if (id != player && !enemyZoneDirty) {
+        enemyZone.Stamp(unit);
+    }
+    return true;
+}
+
+void GameField::RemoveUnit(Vector unit) {
+    units->erase(Unit(player, unit));
+    speculatedUnits = nullptr;
+    enemyZoneDirty = true;
+}
+
+void GameField::ClearUnits() {
+    units->clear();
+    speculatedUnits = nullptr;
+    enemyZoneDirty = true;
 }
 
 bool GameField::CanInsert(const Vector &unit) const {
-    const int halfDistance = distanceToEnemy;
-    for (int x = -halfDistance; x <= halfDistance; x++) {
-        for (int y = -halfDistance; y <= halfDistance; y++) {
-            Vector vec = unit + Vector(x, y);
-            ClampVector(vec);
-            const auto search = units->find(Unit(player, vec));
-            if (search != units->end() && search->player != player) return false;
+    assert(!enemyZoneDirty);
+    return !enemyZone.Test(unit);
+}
+
+void GameField::UpdateEnemyZone() {
+    if (!enemyZoneDirty && enemyZone.GetSize() == size) return;
+    enemyZone.Reset(size);
+    for (const auto &unit : *units) {
+        if (unit.player != player) {
+            enemyZone.Stamp(unit.position);
         }
     }
-    return true;
+    enemyZoneDirty = false;
+}
+
+void GameField::SetSeed(uint32_t seed) {
+    this->seed = seed;
+    random.seed(seed);
+}
+
+int32_t GameField::NextRandom() {
+    std::uniform_int_distribution<int32_t> distr;
+    return distr(random);
+}
+
+void GameField::SaveState(State &state) const {
+    *state.units = *units;
+    state.generation = generation;
+    state.random = random;
+}
+
+void GameField::SwapState(State &state) {
+    units.swap(state.units);
+    std::swap(generation, state.generation);
+    std::swap(random, state.random);
+    enemyZoneDirty = true;
+}
+
+void GameField::FillSnapshot(FieldSnapshot &snapshot, const FieldSnapshot *previous) const {
+    //With prediction on, the player sees the field as it will be when its latest command applies.
+    const std::unordered_set<Unit> *predicted = peer->PredictedUnits();
+    snapshot.tiles.Rebuild(predicted != nullptr ? *predicted : *units, size, previous != nullptr ? &previous->tiles : nullptr);
+    snapshot.size = size;
+    snapshot.turnTime = turnTime;
+    snapshot.generation = generation;
 }
 
 void GameField::SavePreset(unsigned char preset, const std::shared_ptr<std::vector<Vector>> cells) {
     presets->Save(preset, cells);
 }
 
-const std::shared_ptr<std::vector<Vector>> GameField::LoadPreset(unsigned char preset) {
-    currentPreset = preset;
+const std::shared_ptr<std::vector<Vector>> GameField::LoadPreset(unsigned char preset) const {
     return presets->Load(preset);
 }
 
+bool GameField::IsIdle() const {
+    return turnTime == 0 || !peer->IsGameStarted() || peer->IsPaused();
+}
+
 bool GameField::IsGameStopped() const {
     return !peer->IsGameStarted() || peer->IsPause();
 }
 
+void GameField::StartNetwork(std::function<void()> onReceive) {
+    peer->StartThread(onReceive);
+}
+
+void GameField::StopNetwork() {
+    peer->StopThread();
+}
+
 void GameField::Turn() {
-    if (IsGameStopped()) return;
+    if (IsGameStopped()) {
+        //Waiting for another player's commands; get the generation ready so the turn only has to patch it.
+        if (peer->IsGameStarted() && !peer->IsPaused()) {
+            peer->Stall();
+            Speculate();
+        }
+        return;
+    }
     peer->Turn();
 }
 
+void GameField::SetInputDelay(int turns) {
+    peer->SetInputDelay(turns);
+}
+
+std::chrono::steady_clock::time_point GameField::ScheduleTurn(std::chrono::steady_clock::time_point planned) {
+    return peer->ScheduleTurn(planned);
+}
+
 void GameField::Pause() {
     peer->Pause();
 }
 
-void GameField::Update() {
+bool GameField::Update() {
     peer->Update();
     if (peer->Destroyed()) {
 		peer->Cleanup();
-        std::exit(EXIT_SUCCESS);
+        return false;
     }
+    return true;
 }
 
 void GameField::Destroy() {
@@ -13,73 +13,127 @@
 #include <unordered_set>
 #include <vector>
 #include <memory>
+#include <chrono>
+#include <functional>
 #include "Geometry.h"
-
-struct Unit {
-    int player;
-    Geometry::Vector position;
-    
-    Unit(int player, Geometry::Vector position) : player(player), position(position) {}
-    
-    friend bool operator == (const Unit &lhs, const Unit &rhs) {
-        return lhs.position == rhs.position;
-    }
-};
-
-template <>
-struct std::hash<Unit> {
-    size_t operator () (const Unit &unit) const {
-        return std::hash<Geometry::Vector>()(unit.position);
-    }
-};
+#include "Utils.hpp"
+#include "Unit.hpp"
+#include "ProximityMap.hpp"
 
 class GameField {
     static const int distanceToEnemy = 4;
+    
+    //Owners of the units around one cell. A cell has eight neighbours, so its cost does not depend on the number of players.
+    struct Neighbourhood {
+        uint8_t players[8];
+        uint8_t count;
+        //Owner of the unit on the cell plus one, 0 if the cell is empty.
+        uint8_t self;
+        
+        Neighbourhood() : count(0), self(0) {}
+    };
+    
     class Peer *peer;
     std::shared_ptr<class Presets> presets;
     std::shared_ptr<std::unordered_set<Unit>> units;
     Geometry::Vector size;
     int player;
     bool exit;
+    bool enemyZoneDirty;
+    ProximityMap enemyZone;
+    std::vector<Geometry::Vector> presetCells;
     unsigned turnTime;
-    unsigned char currentPreset;
+    uint32_t generation;
+    uint32_t seed;
+    //The game's own sequence: every peer draws from it in the same order, so several games can run in one process.
+    Random::State random;
+    //Scratch set the next generation is built in before it is swapped with units.
+    std::shared_ptr<std::unordered_set<Unit>> next;
+    //While waiting for other players next already holds the generation that follows units if nobody adds a unit.
+    //It stays valid for the units set and generation it was computed from; cells added since then are collected
+    //in touched, and only their neighbourhoods are recomputed when the turn comes.
+    const std::unordered_set<Unit> *speculatedUnits;
+    uint32_t speculatedGeneration;
+    std::vector<Geometry::Vector> touched;
+    std::unordered_set<Geometry::Vector> patchCells;
     
 public:
+    //Everything the simulation continues from. Swapping it with the field lets a peer run ahead of the confirmed turn and come back.
+    struct State {
+        std::shared_ptr<std::unordered_set<Unit>> units;
+        uint32_t generation;
+        Random::State random;
+        
+        State() : units(std::make_shared<std::unordered_set<Unit>>()), generation(0) {}
+    };
+    
     explicit GameField(std::shared_ptr<class Presets> presets);
     explicit GameField(std::shared_ptr<class Presets> presets, Geometry::Vector size, unsigned turnTime, int player);
     
-    static const int maxPlayers = 8;
+    //Player ids are stored in a byte per neighbour.
+    static const int maxPlayers = 64;
+    static_assert(maxPlayers < 256, "A cell's owner plus one has to fit into a byte!");
     
     int Player() const { return player; }
     unsigned TurnTime() const { return turnTime; }
+    uint32_t Generation() const { return generation; }
     Geometry::Vector GetSize() const { return size; }
     bool IsInitialized() const { return player >= 0 && size.x > 0 && size.y > 0; }
+    bool IsIdle() const;
     
     void SetPeer(Peer *peer) { this->peer = peer; }
     void SetTurnTime(unsigned turnTime) { this->turnTime = turnTime; }
     void SetSize(Geometry::Vector size) { this->size = size; }
-    void SetPlayer(int player) { this->player = player; }
+    void SetPlayer(int player) { this->player = player; enemyZoneDirty = true; }
     
     const std::shared_ptr<std::unordered_set<Unit>> GetUnits() const { return units; }
+    //Tiles unchanged since previous keep their stamps, so the renderer's caches skip them.
+    void FillSnapshot(struct FieldSnapshot &snapshot, const struct FieldSnapshot *previous = nullptr) const;
     void ClampVector(Geometry::Vector &vec) const;
-    void AddPreset(const Geometry::Matrix3x3 &matrix);
-    void AddPreset(const Geometry::Matrix3x3 &matrix, int id, unsigned char preset);
+    void AddPreset(const Geometry::Transform &transform, unsigned char preset);
+    void AddPreset(const Geometry::Transform &transform, int id, unsigned char preset);
     void AddUnit(Geometry::Vector unit);
     bool AddUnit(Geometry::Vector unit, int id);
+    //Spectators mirror the field from the frames they receive instead of simulating it.
+    void RemoveUnit(Geometry::Vector unit);
+    void ClearUnits();
+    void SetGeneration(uint32_t generation) { this->generation = generation; }
+    //Seeds the game's random sequence. Ties between players are broken by a hash of the seed, the generation and the cell, so every peer agrees.
+    void SetSeed(uint32_t seed);
+    int32_t NextRandom();
+    //Copies the field into state, reusing the nodes state already has.
+    void SaveState(State &state) const;
+    void SwapState(State &state);
+    void SetInputDelay(int turns);
     
     void SavePreset(unsigned char preset, const std::shared_ptr<std::vector<Geometry::Vector>> cells);
-    const std::shared_ptr<std::vector<Geometry::Vector>> LoadPreset(unsigned char preset);
+    const std::shared_ptr<std::vector<Geometry::Vector>> LoadPreset(unsigned char preset) const;
     
+    //Moves the peer's socket work to its own thread; onReceive is called from it when Update has messages to process.
+    void StartNetwork(std::function<void()> onReceive);
+    void StopNetwork();
     void Turn();
+    std::chrono::steady_clock::time_point ScheduleTurn(std::chrono::steady_clock::time_point planned);
     void Pause();
-    void Update();
+    bool Update();
     void ProcessUnits();
+    //Computes the next generation ahead of the turn, assuming no units are added before it.
+    void Speculate();
     void Destroy();
     
 private:
-    void ProcessUnit(const Unit &unit, std::unordered_map<Geometry::Vector, uint32_t> &processCells);
+    void ProcessUnit(const Unit &unit, std::unordered_map<Geometry::Vector, Neighbourhood> &processCells);
+    //Runs the rules over units into result.
+    void Step(const std::unordered_set<Unit> &units, std::unordered_set<Unit> &result);
+    //Recomputes the cells around the units added after Speculate.
+    void Patch(const std::unordered_set<Unit> &units, std::unordered_set<Unit> &result);
+    //Returns whether the cell is alive in the next generation and stores its owner.
+    bool Resolve(const Geometry::Vector &cell, Neighbourhood &neighbourhood, int &owner) const;
+    bool IsSpeculated() const { return speculatedUnits == units.get() && speculatedGeneration == generation; }
     bool IsGameStopped() const;
     bool CanInsert(const Geometry::Vector &unit) const;
+    void UpdateEnemyZone();
+    void TransformPreset(const Geometry::Transform &transform, const std::vector<Geometry::Vector> &preset);
 };
 
 #endif /* GameField_hpp */
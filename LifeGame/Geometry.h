@@ -19,6 +19,7 @@
 #include "Vector.hpp"
 #include "Rect.hpp"
 #include "Matrix.hpp"
+#include "Transform.hpp"
 
 namespace Geometry {
 
@@ -0,0 +1,209 @@
+//
+//  ImpairmentProxy.cpp
+//  LifeGame
+//
+
+#if !defined(_WIN32)
+#include <netinet/in.h>
+#endif
+
+#include <cmath>
+#include <algorithm>
+#include "ImpairmentProxy.hpp"
+#include "Utils.hpp"
+
+namespace Network {
+
+    typedef ImpairmentProfile::Distribution Distribution;
+    
+    const std::vector<ImpairmentProfile> &ImpairmentProfile::Profiles() {
+        static const std::vector<ImpairmentProfile> profiles = {
+            //Name      Latency Jitter  Distribution            Bandwidth  Stall every, for
+            { "lan",    1.0,    0.5,    Distribution::Uniform,  0,         0,     0   },
+            { "wan",    40.0,   10.0,   Distribution::Normal,   0,         0,     0   },
+            { "jitter", 30.0,   40.0,   Distribution::Pareto,   0,         0,     0   },
+            { "narrow", 20.0,   5.0,    Distribution::Uniform,  16 * 1024, 0,     0   },
+            { "stall",  20.0,   5.0,    Distribution::Uniform,  0,         5000,  500 },
+            { "mobile", 80.0,   30.0,   Distribution::Pareto,   64 * 1024, 7000,  300 }
+        };
+        return profiles;
+    }
+    
+    const ImpairmentProfile *ImpairmentProfile::Find(const std::string &name) {
+        for (const auto &profile : Profiles()) {
+            if (name == profile.name) return &profile;
+        }
+        return nullptr;
+    }
+    
+    ImpairmentProxy::ImpairmentProxy(const ImpairmentProfile &profile, std::shared_ptr<SocketAddress> target) :
+        profile(profile),
+        target(target),
+        buffer(maxChunk),
+        random(std::random_device()()),
+        running(false) {
+        SocketAddress address(INADDR_LOOPBACK, 0);
+        listener = TCPSocket::Create();
+        listener->Bind(address);
+        listener->Listen();
+        poller.Add(listener, false);
+    }
+    
+    ImpairmentProxy::~ImpairmentProxy() {
+        Stop();
+    }
+    
+    void ImpairmentProxy::Start() {
+        if (running) return;
+        start = Clock::now();
+        running = true;
+        thread = std::thread(&ImpairmentProxy::Run, this);
+    }
+    
+    void ImpairmentProxy::Stop() {
+        running = false;
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+    
+    std::string ImpairmentProxy::Address() {
+        SocketAddress address;
+        listener->Addr(address);
+        return address.ToString();
+    }
+    
+    void ImpairmentProxy::Run() {
+        //Delays are far longer than a millisecond, so polling at that rate keeps them accurate enough.
+        while (running) {
+            poller.Wait(outRead, outWrite, false);
+            const Clock::time_point now = Clock::now();
+            for (const TCPSocketPtr &socket : outRead) {
+                if (socket == listener) {
+                    Accept();
+                } else {
+                    Read(socket, now);
+                }
+            }
+            outRead.clear();
+            outWrite.clear();
+            for (auto it = links.begin(); it != links.end();) {
+                Link &link = **it;
+                const bool open = Deliver(link.pipes[0], now);
+                if (Deliver(link.pipes[1], now) && open) {
+                    ++it;
+                    continue;
+                }
+                Close(link);
+                it = links.erase(it);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        for (auto &link : links) {
+            Close(*link);
+        }
+        links.clear();
+    }
+    
+    void ImpairmentProxy::Accept() {
+        SocketAddress address;
+        TCPSocketPtr client = listener->Accept(address);
+        TCPSocketPtr server = TCPSocket::Create();
+        server->Connect(*target);
+        client->NagleAlgorithm(false);
+        server->NagleAlgorithm(false);
+        
+        std::unique_ptr<Link> link(new Link());
+        link->pipes[0].from = client;
+        link->pipes[0].to = server;
+        link->pipes[1].from = server;
+        link->pipes[1].to = client;
+        readers[client.get()] = &link->pipes[0];
+        readers[server.get()] = &link->pipes[1];
+        poller.Add(client, false);
+        poller.Add(server, false);
+        links.push_back(std::move(link));
+    }
+    
+    void ImpairmentProxy::Read(const TCPSocketPtr &socket, Clock::time_point now) {
+        auto reader = readers.find(socket.get());
+        if (reader == readers.end()) return;
+        Pipe &pipe = *reader->second;
+        if (pipe.closed || pipe.queued >= maxQueued) return;
+        const int size = socket->Recv(buffer.data(), buffer.size());
+        if (size == 0) {
+            pipe.closed = true;
+            poller.Remove(socket);
+            return;
+        }
+        Chunk chunk;
+        chunk.data.assign(buffer.begin(), buffer.begin() + size);
+        chunk.sent = 0;
+        chunk.due = Due(pipe, static_cast<uint32_t>(size), now);
+        pipe.queued += static_cast<uint32_t>(size);
+        pipe.chunks.push_back(std::move(chunk));
+    }
+    
+    bool ImpairmentProxy::Deliver(Pipe &pipe, Clock::time_point now) {
+        while (!pipe.chunks.empty() && pipe.chunks.front().due <= now) {
+            Chunk &chunk = pipe.chunks.front();
+            IOBuffer data = { chunk.data.data() + chunk.sent, chunk.data.size() - chunk.sent };
+            chunk.sent += static_cast<uint32_t>(pipe.to->Send(&data, 1));
+            if (chunk.sent < chunk.data.size()) break;
+            pipe.queued -= static_cast<uint32_t>(chunk.data.size());
+            pipe.chunks.pop_front();
+        }
+        return !pipe.closed || !pipe.chunks.empty();
+    }
+    
+    void ImpairmentProxy::Close(Link &link) {
+        for (Pipe &pipe : link.pipes) {
+            if (!pipe.closed) {
+                poller.Remove(pipe.from);
+            }
+            readers.erase(pipe.from.get());
+        }
+    }
+    
+    ImpairmentProxy::Clock::time_point ImpairmentProxy::Due(Pipe &pipe, uint32_t size, Clock::time_point now) {
+        typedef std::chrono::duration<double, std::milli> Milliseconds;
+        Clock::time_point due = now;
+        if (profile.bandwidth > 0) {
+            //Bytes leave one after another at the link's rate.
+            pipe.busy = std::max(pipe.busy, now) + std::chrono::duration_cast<Clock::duration>(Milliseconds(1000.0 * size / profile.bandwidth));
+            due = pipe.busy;
+        }
+        due += std::chrono::duration_cast<Clock::duration>(Milliseconds(Delay()));
+        due = std::max(due, pipe.lastDue);
+        if (profile.stallInterval > 0) {
+            const auto phase = std::chrono::duration_cast<std::chrono::milliseconds>(due - start).count() % profile.stallInterval;
+            if (phase < profile.stallTime) {
+                due += std::chrono::milliseconds(profile.stallTime - phase);
+            }
+        }
+        pipe.lastDue = due;
+        return due;
+    }
+    
+    double ImpairmentProxy::Delay() {
+        double delay = profile.latency;
+        switch (profile.distribution) {
+            case Distribution::Constant:
+                break;
+            case Distribution::Uniform:
+                delay += std::uniform_real_distribution<double>(-profile.jitter, profile.jitter)(random);
+                break;
+            case Distribution::Normal:
+                delay += std::normal_distribution<double>(0.0, profile.jitter)(random);
+                break;
+            case Distribution::Pareto: {
+                //Shape 2: the extra delay averages jitter, and one chunk in a hundred waits more than nine times that.
+                const double uniform = std::uniform_real_distribution<double>(0.0, 1.0)(random);
+                delay += profile.jitter * (1.0 / std::sqrt(1.0 - uniform) - 1.0);
+                break;
+            }
+        }
+        return std::max(delay, 0.0);
+    }
+
+}
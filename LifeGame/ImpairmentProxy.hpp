@@ -0,0 +1,120 @@
+//
+//  ImpairmentProxy.hpp
+//  LifeGame
+//
+
+#ifndef ImpairmentProxy_hpp
+#define ImpairmentProxy_hpp
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <unordered_map>
+#include "SocketPoller.hpp"
+
+namespace Network {
+
+    //How a link misbehaves, the same in both directions.
+    struct ImpairmentProfile {
+        enum class Distribution {
+            Constant,
+            Uniform,
+            Normal,
+            //Long tail: most bytes are on time and a few are very late, like retransmissions on a lossy link.
+            Pareto
+        };
+        
+        const char *name;
+        //One way delay and its spread in milliseconds.
+        double latency;
+        double jitter;
+        Distribution distribution;
+        //Bytes per second, 0 for no limit.
+        uint32_t bandwidth;
+        //Every stallInterval milliseconds nothing is delivered for stallTime milliseconds.
+        uint32_t stallInterval;
+        uint32_t stallTime;
+        
+        static const std::vector<ImpairmentProfile> &Profiles();
+        //Returns nullptr if there is no profile with that name.
+        static const ImpairmentProfile *Find(const std::string &name);
+    };
+    
+    //Loopback proxy that forwards every connection it accepts to target and holds the bytes back on the way,
+    //so WAN conditions can be reproduced between peers on one machine. TCP keeps bytes in order,
+    //so a late chunk delays everything behind it, which is how reordering on the wire shows up to the game.
+    class ImpairmentProxy {
+        typedef std::chrono::steady_clock Clock;
+        
+        static const uint32_t maxChunk = 64 * 1024;
+        //Bytes held per direction before the proxy stops reading, so a slow link pushes back on the sender.
+        static const uint32_t maxQueued = 1024 * 1024;
+        
+        struct Chunk {
+            std::vector<uint8_t> data;
+            uint32_t sent;
+            Clock::time_point due;
+        };
+        
+        //One direction of a connection.
+        struct Pipe {
+            TCPSocketPtr from;
+            TCPSocketPtr to;
+            std::deque<Chunk> chunks;
+            uint32_t queued;
+            //The link is busy sending earlier bytes until then.
+            Clock::time_point busy;
+            Clock::time_point lastDue;
+            bool closed;
+            
+            Pipe() : queued(0), closed(false) {}
+        };
+        
+        struct Link {
+            Pipe pipes[2];
+        };
+        
+        const ImpairmentProfile profile;
+        std::shared_ptr<SocketAddress> target;
+        TCPSocketPtr listener;
+        SocketPoller poller;
+        std::vector<TCPSocketPtr> outRead;
+        std::vector<TCPSocketPtr> outWrite;
+        std::vector<std::unique_ptr<Link>> links;
+        std::unordered_map<const TCPSocket *, Pipe *> readers;
+        std::vector<uint8_t> buffer;
+        //Separate from the game's random sequence, which every peer has to consume in the same way.
+        std::mt19937 random;
+        Clock::time_point start;
+        std::atomic<bool> running;
+        std::thread thread;
+    
+    public:
+        explicit ImpairmentProxy(const ImpairmentProfile &profile, std::shared_ptr<SocketAddress> target);
+        ~ImpairmentProxy();
+        ImpairmentProxy(const ImpairmentProxy &other) = delete;
+        ImpairmentProxy &operator = (const ImpairmentProxy &other) = delete;
+        
+        void Start();
+        void Stop();
+        std::string Address();
+    
+    private:
+        void Run();
+        void Accept();
+        void Read(const TCPSocketPtr &socket, Clock::time_point now);
+        //Sends the chunks that are due and returns false once the pipe is closed and drained.
+        bool Deliver(Pipe &pipe, Clock::time_point now);
+        void Close(Link &link);
+        Clock::time_point Due(Pipe &pipe, uint32_t size, Clock::time_point now);
+        double Delay();
+    };
+
+}
+
+#endif /* ImpairmentProxy_hpp */
@@ -0,0 +1,23 @@
+//
+//  LatencyMeter.cpp
+//  LifeGame
+//
+
+#include <cmath>
+#include "LatencyMeter.hpp"
+
+namespace Messaging {
+
+    void LatencyMeter::AddSample(double sample) {
+        const double gain = 1.0 / 8.0;
+        const double deviationGain = 1.0 / 4.0;
+        if (samples++ == 0) {
+            roundTrip = sample;
+            deviation = sample / 2.0;
+            return;
+        }
+        deviation += deviationGain * (std::fabs(sample - roundTrip) - deviation);
+        roundTrip += gain * (sample - roundTrip);
+    }
+    
+}
@@ -0,0 +1,32 @@
+//
+//  LatencyMeter.hpp
+//  LifeGame
+//
+
+#ifndef LatencyMeter_hpp
+#define LatencyMeter_hpp
+
+#include <stdint.h>
+
+namespace Messaging {
+
+    //Smoothed round-trip time and its mean deviation, estimated like the TCP retransmission timer.
+    class LatencyMeter {
+        uint32_t samples;
+        double roundTrip;
+        double deviation;
+        
+    public:
+        explicit LatencyMeter() : samples(0), roundTrip(0.0), deviation(0.0) {}
+        
+        void AddSample(double roundTrip);
+        uint32_t Samples() const { return samples; }
+        double RoundTrip() const { return roundTrip; }
+        double Deviation() const { return deviation; }
+        //Round trip that is rarely exceeded, in the same units as the samples.
+        double Bound() const { return roundTrip + 4.0 * deviation; }
+    };
+    
+}
+
+#endif /* LatencyMeter_hpp */
@@ -0,0 +1,72 @@
+//
+//  LoopWaker.cpp
+//  LifeGame
+//
+
+#if defined(_WIN32)
+#include <windows.h>
+#elif defined(__APPLE__)
+#include <CoreFoundation/CoreFoundation.h>
+#include <GLUT/GLUT.h>
+#else
+#include <stdint.h>
+#include <GL/glx.h>
+#endif
+
+#include "LoopWaker.hpp"
+
+#if defined(__APPLE__)
+//GLUT runs on the main run loop, so the source fires on its thread.
+static void Perform(void *) {
+    glutPostRedisplay();
+}
+#endif
+
+LoopWaker::LoopWaker() : handle(nullptr), display(nullptr) {}
+
+LoopWaker::~LoopWaker() {
+#if defined(__APPLE__)
+    if (handle != nullptr) {
+        CFRunLoopSourceInvalidate(static_cast<CFRunLoopSourceRef>(handle));
+        CFRelease(static_cast<CFRunLoopSourceRef>(handle));
+    }
+#elif !defined(_WIN32)
+    if (display != nullptr) {
+        XCloseDisplay(static_cast<Display *>(display));
+    }
+#endif
+}
+
+void LoopWaker::Attach() {
+#if defined(_WIN32)
+    handle = WindowFromDC(wglGetCurrentDC());
+#elif defined(__APPLE__)
+    CFRunLoopSourceContext context = {};
+    context.perform = Perform;
+    CFRunLoopSourceRef source = CFRunLoopSourceCreate(kCFAllocatorDefault, 0, &context);
+    CFRunLoopAddSource(CFRunLoopGetMain(), source, kCFRunLoopCommonModes);
+    handle = source;
+#else
+    display = XOpenDisplay(nullptr);
+    if (display == nullptr) return;
+    handle = reinterpret_cast<void *>(static_cast<uintptr_t>(glXGetCurrentDrawable()));
+#endif
+}
+
+void LoopWaker::Post() {
+    if (handle == nullptr) return;
+#if defined(_WIN32)
+    InvalidateRect(static_cast<HWND>(handle), nullptr, FALSE);
+#elif defined(__APPLE__)
+    CFRunLoopSourceSignal(static_cast<CFRunLoopSourceRef>(handle));
+    CFRunLoopWakeUp(CFRunLoopGetMain());
+#else
+    Display *connection = static_cast<Display *>(display);
+    XEvent event = {};
+    event.xexpose.type = Expose;
+    event.xexpose.display = connection;
+    event.xexpose.window = static_cast<::Window>(reinterpret_cast<uintptr_t>(handle));
+    XSendEvent(connection, event.xexpose.window, False, ExposureMask, &event);
+    XFlush(connection);
+#endif
+}
@@ -0,0 +1,29 @@
+//
+//  LoopWaker.hpp
+//  LifeGame
+//
+
+#ifndef LoopWaker_hpp
+#define LoopWaker_hpp
+
+//Wakes a sleeping GLUT loop from another thread. GLUT itself may only be called from its own thread,
+//so the system is asked to redraw the window instead, and GLUT answers that with the display callback.
+class LoopWaker {
+    //The window on Windows and X11, the run loop source on macOS.
+    void *handle;
+    //The X connection the wake-ups are sent through, apart from the one GLUT reads.
+    void *display;
+
+public:
+    explicit LoopWaker();
+    ~LoopWaker();
+    LoopWaker(const LoopWaker &other) = delete;
+    LoopWaker &operator = (const LoopWaker &other) = delete;
+
+    //Called on the GLUT thread while the window to redraw is current.
+    void Attach();
+    //Safe from any thread, but not from two threads at once.
+    void Post();
+};
+
+#endif /* LoopWaker_hpp */
@@ -14,15 +14,22 @@
 
 namespace Network {
     
-    MemoryStream::MemoryStream(uint32_t capacity) : size(0), capacity(capacity) {
+    MemoryStream::MemoryStream(uint32_t capacity) : size(0), capacity(capacity), owner(true) {
         buffer = static_cast<uint8_t *>(std::malloc(capacity));
     }
     
+    MemoryStream::MemoryStream() : buffer(nullptr), size(0), capacity(0), owner(false) {}
+    
     MemoryStream::~MemoryStream() {
-        std::free(buffer);
+        if (owner) {
+            std::free(buffer);
+        }
     }
     
     void MemoryStream::Realloc(uint32_t size) {
+        if (!owner) {
+            throw std::logic_error("Memory view can not be reallocated!");
+        }
         void *newPtr = std::realloc(buffer, size);
         if (newPtr == nullptr) {
             throw std::bad_alloc();
@@ -38,25 +45,59 @@ namespace Network {
         size = newSize;
     }
     
-    InputMemoryStream::InputMemoryStream(uint32_t capacity) : MemoryStream(capacity) {}
+    InputMemoryStream::InputMemoryStream(uint32_t capacity) : MemoryStream(capacity), position(0) {}
+    
+    InputMemoryStream::InputMemoryStream() : MemoryStream(), position(0) {}
     
-    uint32_t InputMemoryStream::Serialize(void *data, uint32_t bytesCount, uint32_t pos) {
-        if (capacity - pos < bytesCount) {
-            throw std::out_of_range("Not enough data!");
+    void InputMemoryStream::Wrap(const void *data, uint32_t length) {
+        if (owner) {
+            std::free(buffer);
+            owner = false;
         }
-        std::memcpy(data, buffer + pos, bytesCount);
-        return bytesCount;
+        buffer = static_cast<uint8_t *>(const_cast<void *>(data));
+        capacity = length;
+        size = length;
+        position = 0;
+    }
+    
+    uint64_t InputMemoryStream::ReadVarint() {
+        uint64_t result = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            uint8_t byte;
+            *this >> byte;
+            result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0) return result;
+        }
+        throw std::out_of_range("Varint is too long!");
+    }
+    
+    int64_t InputMemoryStream::ReadSignedVarint() {
+        const uint64_t value = ReadVarint();
+        return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
     }
     
     OutputMemoryStream::OutputMemoryStream(uint32_t capacity) : MemoryStream(capacity) {}
     
-    uint32_t OutputMemoryStream::Serialize(void *data, uint32_t bytesCount, uint32_t pos) {
-        const uint32_t newSize = pos + bytesCount;
-        if (newSize > capacity) {
-            Realloc(std::max(capacity * 2, newSize));
+    void OutputMemoryStream::WriteVarint(uint64_t value) {
+        Reserve(size, VarintSize(value));
+        while (value >= 0x80) {
+            buffer[size++] = static_cast<uint8_t>(value | 0x80);
+            value >>= 7;
+        }
+        buffer[size++] = static_cast<uint8_t>(value);
+    }
+    
+    void OutputMemoryStream::WriteSignedVarint(int64_t value) {
+        WriteVarint((static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63));
+    }
+    
+    uint32_t OutputMemoryStream::VarintSize(uint64_t value) {
+        uint32_t result = 1;
+        while (value >= 0x80) {
+            value >>= 7;
+            result++;
         }
-        std::memcpy(buffer + pos, data, bytesCount);
-        return bytesCount;
+        return result;
     }
     
 }
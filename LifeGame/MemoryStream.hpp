@@ -10,78 +10,51 @@
 #define MemoryStream_hpp
 
 #include <vector>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
 #include <type_traits>
 #include <stdint.h>
 
 namespace Network {
     
-    template <typename From, typename To>
-    class TypeAliaser {
-        union {
-            From from;
-            To to;
-        };
-        
-    public:
-        TypeAliaser(From from) : from(from) {}
-        constexpr To Get() const { return to; }
-    };
-    
-    template <typename T, size_t size>
-    struct ByteSwapper {};
+    //The wire format is little-endian, so on little-endian hosts values and arrays are plain copies.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    const bool WireByteSwap = true;
+#else
+    const bool WireByteSwap = false;
+#endif
     
     template <typename T>
-    T ByteSwap(T data, bool out) {
-        return ByteSwapper<T, sizeof(T)>().Swap(data, out);
+    T ByteSwap(T data) {
+        uint8_t bytes[sizeof(T)];
+        std::memcpy(bytes, &data, sizeof(T));
+        std::reverse(bytes, bytes + sizeof(T));
+        std::memcpy(&data, bytes, sizeof(T));
+        return data;
     }
     
+    //Converts between host and wire byte order; the conversion is symmetric.
     template <typename T>
-    struct ByteSwapper<T, 1> {
-        T Swap(T data, bool out) {
-            return data;
-        }
-    };
-    
-    template <typename T>
-    struct ByteSwapper<T, 2> {
-        T Swap(T data, bool out) {
-            uint16_t temp = TypeAliaser<T, uint16_t>(data).Get();
-            uint16_t result = out ? htons(temp) : ntohs(temp);
-            return TypeAliaser<uint16_t, T>(result).Get();
-        }
-    };
-    
-    template <typename T>
-    struct ByteSwapper<T, 4> {
-        T Swap(T data, bool out) {
-            uint32_t temp = TypeAliaser<T, uint32_t>(data).Get();
-            uint32_t result = out ? htonl(temp) : ntohl(temp);
-            return TypeAliaser<uint32_t, T>(result).Get();
-        }
-    };
-    
-    template <typename T>
-    struct ByteSwapper<T, 8> {
-        T Swap(T data, bool out) {
-            uint64_t temp = TypeAliaser<T, uint64_t>(data).Get();
-            uint64_t result = out ? htonll(temp) : ntohll(temp);
-            return TypeAliaser<uint64_t, T>(result).Get();
-        }
-    };
+    T WireOrder(T data) {
+        static_assert(std::is_arithmetic<T>::value || std::is_enum<T>::value, "Only primitive data types have a wire order!");
+        return WireByteSwap ? ByteSwap(data) : data;
+    }
     
     class MemoryStream {
-    private:
-        virtual uint32_t Serialize(void *data, uint32_t bytesCount, uint32_t pos) = 0;
-        virtual bool IsInput() const = 0;
-        
     protected:
         uint8_t *buffer;
         uint32_t size;
         uint32_t capacity;
+        bool owner;
         
-    public:
+        explicit MemoryStream();
         explicit MemoryStream(uint32_t capacity);
-        virtual ~MemoryStream() = 0;
+        ~MemoryStream();
+        
+    public:
+        MemoryStream(const MemoryStream &) = delete;
+        MemoryStream &operator=(const MemoryStream &) = delete;
         
         uint32_t Capacity() const { return capacity; }
         uint32_t Size() const { return size; }
@@ -90,66 +63,116 @@ namespace Network {
         void Clear() { size = 0; }
         void Resize(uint32_t newSize);
         void Realloc(uint32_t size);
-        
-    protected:
-        template <typename T>
-        uint32_t Serialize(T &data, uint32_t pos) {
-            static_assert(std::is_arithmetic<T>::value || std::is_enum<T>::value, "Template Serialize only supports primitive data types!");
-            uint32_t result;
-            if (IsInput()) {
-                T temp;
-                result = Serialize(&temp, sizeof(T), pos);
-                data = ByteSwap(temp, false);
-            } else {
-                T swapped = ByteSwap(data, true);
-                result = Serialize(&swapped, sizeof(T), pos);
-            }
-            return result;
-        }
     };
     
     class InputMemoryStream : public MemoryStream {
-    private:
-        virtual bool IsInput() const override { return true; }
-        virtual uint32_t Serialize(void *data, uint32_t bytesCount, uint32_t pos) override;
+        uint32_t position;
         
     public:
         explicit InputMemoryStream(uint32_t capacity);
-        ~InputMemoryStream() override {}
+        //Creates an empty read-only view, see Wrap.
+        explicit InputMemoryStream();
+        
+        //Reads length bytes owned by someone else starting from the beginning; data must outlive the reads.
+        void Wrap(const void *data, uint32_t length);
+        uint32_t Position() const { return position; }
+        uint32_t Remaining() const { return size - position; }
         
         template <typename T>
-        void Read(T &data, uint32_t pos) {
-            MemoryStream::Serialize(data, pos);
+        void Read(T &data, uint32_t pos) const {
+            Check(pos, sizeof(T));
+            std::memcpy(&data, buffer + pos, sizeof(T));
+            data = WireOrder(data);
         }
         
+        template <typename T>
+        void ReadArray(T *data, uint32_t count) {
+            static_assert(std::is_arithmetic<T>::value, "ReadArray only supports primitive data types!");
+            const uint32_t bytesCount = count * sizeof(T);
+            if (count != 0 && bytesCount / count != sizeof(T)) {
+                throw std::out_of_range("Not enough data!");
+            }
+            Check(position, bytesCount);
+            std::memcpy(data, buffer + position, bytesCount);
+            position += bytesCount;
+            if (!WireByteSwap) return;
+            for (uint32_t i = 0; i < count; i++) {
+                data[i] = ByteSwap(data[i]);
+            }
+        }
+        
+        //Returns count bytes in place and skips them.
+        const uint8_t *ReadBytes(uint32_t count) {
+            Check(position, count);
+            const uint8_t *result = buffer + position;
+            position += count;
+            return result;
+        }
+        
+        uint64_t ReadVarint();
+        int64_t ReadSignedVarint();
+        
         template <typename T>
         friend InputMemoryStream &operator >> (InputMemoryStream &stream, T &data) {
-            uint32_t result = stream.MemoryStream::Serialize(data, stream.size);
-            stream.size += result;
+            stream.Read(data, stream.position);
+            stream.position += sizeof(T);
             return stream;
         }
+        
+    private:
+        void Check(uint32_t pos, uint32_t bytesCount) const {
+            if (pos > size || size - pos < bytesCount) {
+                throw std::out_of_range("Not enough data!");
+            }
+        }
     };
     
     class OutputMemoryStream : public MemoryStream {
-    private:
-        virtual bool IsInput() const override { return false; }
-        virtual uint32_t Serialize(void *data, uint32_t bytesCount, uint32_t pos) override;
-        
     public:
         explicit OutputMemoryStream(uint32_t capacity);
-        ~OutputMemoryStream() override {}
         
         template <typename T>
         void Write(T data, uint32_t pos) {
-            MemoryStream::Serialize(data, pos);
+            data = WireOrder(data);
+            Reserve(pos, sizeof(T));
+            std::memcpy(buffer + pos, &data, sizeof(T));
+        }
+        
+        template <typename T>
+        void WriteArray(const T *data, uint32_t count) {
+            static_assert(std::is_arithmetic<T>::value, "WriteArray only supports primitive data types!");
+            const uint32_t bytesCount = count * sizeof(T);
+            Reserve(size, bytesCount);
+            if (WireByteSwap) {
+                for (uint32_t i = 0; i < count; i++) {
+                    const T swapped = ByteSwap(data[i]);
+                    std::memcpy(buffer + size + i * sizeof(T), &swapped, sizeof(T));
+                }
+            } else {
+                std::memcpy(buffer + size, data, bytesCount);
+            }
+            size += bytesCount;
         }
         
+        //Seven bits per byte, low bits first; small values take a single byte.
+        void WriteVarint(uint64_t value);
+        //Zigzag-maps the value first, so small negative numbers stay short too.
+        void WriteSignedVarint(int64_t value);
+        static uint32_t VarintSize(uint64_t value);
+        
         template <typename T>
         friend OutputMemoryStream &operator << (OutputMemoryStream &stream, T data) {
-            uint32_t result = stream.MemoryStream::Serialize(data, stream.size);
-            stream.size += result;
+            stream.Write(data, stream.size);
+            stream.size += sizeof(T);
             return stream;
         }
+        
+    private:
+        void Reserve(uint32_t pos, uint32_t bytesCount) {
+            if (pos + bytesCount > capacity) {
+                Realloc(std::max(capacity * 2, pos + bytesCount));
+            }
+        }
     };
     
 }
@@ -6,20 +6,32 @@
 //  Copyright © 2017 Arsonist (gmoximko@icloud.com). All rights reserved.
 //
 
+#if !defined(_WIN32)
+#include <netinet/in.h>
+#endif
+
 #include <cassert>
 #include <string>
 #include <algorithm>
-#include "Messenger.hpp"
-
-#if defined(_WIN32)
+#include <chrono>
 #include "Utils.hpp"
-#endif
+#include "Allocations.hpp"
+#include "Messenger.hpp"
 
 using namespace Network;
 
 namespace Messaging {
-    
-	Messenger::Messenger() {
+
+    const size_t Messenger::pooledMessages = 64;
+    const size_t Messenger::pooledMessageSize = 256;
+
+	Messenger::Messenger() :
+        emitted(false),
+        posted(false),
+        threaded(false),
+        running(false),
+        woken(false),
+        deliveryAllocations(0) {
 #if defined(_WIN32)
 		WSADATA data;
 		int result = WSAStartup(MAKEWORD(2, 2), &data);
@@ -30,6 +42,7 @@ namespace Messaging {
 	}
 
     Messenger::~Messenger() {
+        StopThread();
 		if (!Destroyed()) {
 			Destroy();
 			Cleanup();
@@ -38,117 +51,369 @@ namespace Messaging {
 
     void Messenger::Destroy() {
         OnDestroy();
-        Remove(listener, recvList);
         listener.reset();
-        
-        sendList.clear();
-        exceptList.clear();
-		
-        for (auto &connection : connections) {
-            connection->Close();
+        Post({ Operation::Type::StopListening, nullptr, nullptr });
+
+        for (auto &it : connections) {
+            Post({ Operation::Type::Close, it.second, nullptr });
         }
+        Flush();
     }
 
 	void Messenger::Cleanup() {
+        StopThread();
 #if defined(_WIN32)
 		int result = WSACleanup();
 		if (result != 0) {
 			Log::Error("WSACleanup failed!");
 		}
 #endif
-		assert(recvList.size() == 0);
-		assert(sendList.size() == 0);
-		assert(exceptList.size() == 0);
+		assert(poller.Empty());
 		assert(connections.size() == 0);
 		assert(Destroyed());
 	}
 
     void Messenger::Update(bool block) {
-        if (recvList.size() == 0 && sendList.size() == 0 && exceptList.size() == 0) return;
-        std::vector<TCPSocketPtr> outRead;
-        std::vector<TCPSocketPtr> outWrite;
-        std::vector<TCPSocketPtr> outExcept;
-        SocketSelector::Select(&recvList, &outRead, &sendList, &outWrite, &exceptList, &outExcept, block);
+        if (Threaded()) {
+            OnUpdate();
+            Event event;
+            while (events.Pop(event)) {
+                Dispatch(event);
+                if (event.message.capacity() != 0 && !recycled.Full()) {
+                    recycled.Push(std::move(event.message));
+                }
+            }
+            Flush();
+            return;
+        }
+        if (poller.Empty()) return;
+        OnUpdate();
+        //Data queued outside of Update has to leave before a blocking wait.
+        WritePending();
+        poller.Wait(outRead, outWrite, block);
         Read(outRead);
         Write(outWrite);
-        Except(outExcept);
+        outRead.clear();
+        outWrite.clear();
+        WritePending();
     }
 
-    void Messenger::Read(const std::vector<TCPSocketPtr> &outRead) {
-        NewConnection(outRead);
-        for (TCPSocketPtr socket : outRead) {
-            auto iter = std::find_if(connections.begin(), connections.end(), [socket](ConnectionPtr c){ return socket == c->socket; });
-            if (iter == connections.end()) continue;
-            ConnectionPtr connection = *iter;
-            if (connection->Recv() == 0) {
-                CloseConnection(connection, true);
-            } else if (connection->CanRead()) {
+    void Messenger::Flush() {
+        if (!Threaded()) {
+            WritePending();
+            return;
+        }
+        while (!operationBacklog.empty() && !operations.Full()) {
+            operations.Push(std::move(operationBacklog.front()));
+            operationBacklog.pop_front();
+        }
+        if (posted) {
+            posted = false;
+            Wake();
+        }
+    }
+
+    void Messenger::StartThread(std::function<void()> onEvents) {
+        if (Threaded()) return;
+        this->onEvents = onEvents;
+        if (recycled.Empty()) {
+            for (size_t i = 0; i < pooledMessages; i++) {
+                std::vector<uint8_t> message;
+                message.reserve(pooledMessageSize);
+                recycled.Push(std::move(message));
+            }
+        }
+        TCPSocketPtr wakeListener = TCPSocket::Create();
+        SocketAddress wakeAddress(INADDR_LOOPBACK, 0);
+        wakeListener->Bind(wakeAddress);
+        wakeListener->Listen(1);
+        wakeListener->Addr(wakeAddress);
+        wakeSender = TCPSocket::Create();
+        wakeSender->Connect(wakeAddress);
+        wakeSender->NagleAlgorithm(false);
+        wakeReceiver = wakeListener->Accept(wakeAddress);
+        poller.Add(wakeReceiver, false);
+        woken = false;
+        running = true;
+        threaded = true;
+        thread = std::thread(&Messenger::Run, this);
+    }
+
+    void Messenger::StopThread() {
+        if (!Threaded()) return;
+        //Everything posted so far has to reach the I/O thread before it stops.
+        while (!operationBacklog.empty()) {
+            Flush();
+            std::this_thread::yield();
+        }
+        running = false;
+        woken = false;
+        Wake();
+        thread.join();
+        threaded = false;
+        poller.Remove(wakeReceiver);
+        wakeReceiver.reset();
+        wakeSender.reset();
+        //Events the owner has not seen yet are handled without the thread, which keeps Destroyed accurate.
+        EmitBacklog();
+        Event event;
+        while (events.Pop(event)) {
+            Dispatch(event);
+        }
+        while (!eventBacklog.empty()) {
+            Dispatch(eventBacklog.front());
+            eventBacklog.pop_front();
+        }
+    }
+
+    void Messenger::Run() {
+        while (running) {
+            poller.Wait(outRead, outWrite, eventBacklog.empty());
+            Read(outRead);
+            Write(outWrite);
+            outRead.clear();
+            outWrite.clear();
+            ExecuteOperations();
+            WritePending();
+            EmitBacklog();
+            if (emitted) {
+                emitted = false;
+                onEvents();
+            }
+            //The owner is behind; give it a moment instead of spinning on the poller.
+            if (!eventBacklog.empty()) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+        ExecuteOperations();
+        WritePending();
+    }
+
+    void Messenger::Wake() {
+        if (woken.exchange(true)) return;
+        uint8_t signal = 0;
+        wakeSender->Send(&signal, sizeof(signal));
+    }
+
+    void Messenger::Post(Operation operation) {
+        if (!Threaded()) {
+            Execute(operation);
+            return;
+        }
+        posted = true;
+        if (operationBacklog.empty() && !operations.Full()) {
+            operations.Push(std::move(operation));
+        } else {
+            operationBacklog.push_back(std::move(operation));
+        }
+    }
+
+    void Messenger::Dispatch(Event &event) {
+        const ConnectionPtr &connection = event.connection;
+        switch (event.type) {
+            case Event::Type::Accept:
+                OnNewConnection(connection);
+                break;
+            case Event::Type::Message:
+                if (Find(connection->socket) == nullptr) break;
+                connection->input.Wrap(event.message.data(), static_cast<uint32_t>(event.message.size()));
+                received = event.received;
                 OnMessageRecv(connection);
-                connection->Clear();
+                break;
+            case Event::Type::Close:
+                if (Find(connection->socket) == nullptr) break;
+                CloseConnection(connection, true);
+                break;
+        }
+    }
+
+    void Messenger::Read(const std::vector<TCPSocketPtr> &outRead) {
+        for (const TCPSocketPtr &socket : outRead) {
+            if (socket == acceptor) {
+                Accept();
+                continue;
+            }
+            if (socket == wakeReceiver) {
+                //Cleared before the operations are drained, so a post racing with this read wakes the thread again.
+                woken = false;
+                uint8_t signals[64];
+                IOBuffer buffer = { signals, sizeof(signals) };
+                while (socket->Recv(&buffer, 1) > 0) {}
+                continue;
+            }
+            ConnectionPtr connection = FindPolled(socket);
+            if (connection == nullptr) continue;
+            //Readiness is edge-triggered, so keep reading until the socket would block.
+            while (true) {
+                const int result = connection->Recv();
+                if (result < 0) break;
+                if (result == 0) {
+                    Disconnect(connection);
+                    break;
+                }
+                Deliver(connection);
+                if (FindPolled(socket) == nullptr) break;
             }
         }
     }
 
     void Messenger::Write(const std::vector<TCPSocketPtr> &outWrite) {
-        for (TCPSocketPtr socket : outWrite) {
-            auto iter = std::find_if(connections.begin(), connections.end(), [socket](ConnectionPtr c){ return socket == c->socket; });
-            if (iter == connections.end()) continue;
-            ConnectionPtr connection = *iter;
+        for (const TCPSocketPtr &socket : outWrite) {
+            ConnectionPtr connection = FindPolled(socket);
+            if (connection == nullptr) continue;
             connection->Send();
             if (connection->CanWrite()) {
-                Remove(connection->socket, sendList);
-                OnMessageSend(connection);
+                poller.SetWrite(connection->socket, false);
+            }
+        }
+    }
+
+    void Messenger::WritePending() {
+        for (const ConnectionPtr &connection : pending) {
+            connection->pending = false;
+            if (FindPolled(connection->socket) == nullptr) continue;
+            connection->Send();
+            if (!connection->CanWrite()) {
+                poller.SetWrite(connection->socket, true);
             }
         }
+        pending.clear();
     }
 
-    void Messenger::Except(const std::vector<TCPSocketPtr> &outExcept) {}
+    void Messenger::Execute(Operation &operation) {
+        const ConnectionPtr &connection = operation.connection;
+        switch (operation.type) {
+            case Operation::Type::Add:
+                polled[connection->socket.get()] = connection;
+                poller.Add(connection->socket);
+                break;
+            case Operation::Type::Send:
+                connection->Enqueue(operation.buffer);
+                if (!connection->pending) {
+                    connection->pending = true;
+                    pending.push_back(connection);
+                }
+                break;
+            case Operation::Type::Close:
+                poller.SetWrite(connection->socket, false);
+                connection->Close();
+                break;
+            case Operation::Type::Remove:
+                poller.Remove(connection->socket);
+                polled.erase(connection->socket.get());
+                break;
+            case Operation::Type::StopListening:
+                poller.Remove(acceptor);
+                acceptor.reset();
+                break;
+        }
+    }
+
+    void Messenger::ExecuteOperations() {
+        Operation operation;
+        while (operations.Pop(operation)) {
+            Execute(operation);
+        }
+    }
 
-    void Messenger::NewConnection(const std::vector<TCPSocketPtr> &outRead) {
-        if (listener == nullptr || std::find(outRead.begin(), outRead.end(), listener) == outRead.end()) return;
-        TCPSocketPtr socket = listener->Accept(*address);
+    void Messenger::Accept() {
+        TCPSocketPtr socket = acceptor->Accept(*address);
         ConnectionPtr connection = std::make_shared<Connection>(socket);
-        OnNewConnection(connection);
+        if (Threaded()) {
+            Emit({ Event::Type::Accept, connection, {}, Clock::time_point() });
+        } else {
+            OnNewConnection(connection);
+        }
+    }
+
+    void Messenger::Deliver(const ConnectionPtr connection) {
+        if (!Threaded()) {
+            received = Clock::now();
+            while (connection->NextMessage()) {
+                OnMessageRecv(connection);
+                if (FindPolled(connection->socket) == nullptr) break;
+            }
+            return;
+        }
+        const Clock::time_point now = Clock::now();
+        uint64_t allocations = 0;
+        {
+            AllocationScope scope(allocations);
+            //A pooled buffer is taken only for a complete message; a new one is made only while the owner holds them all.
+            while (connection->CanRead()) {
+                std::vector<uint8_t> message;
+                recycled.Pop(message);
+                connection->PopMessage(message);
+                Emit({ Event::Type::Message, connection, std::move(message), now });
+            }
+        }
+        deliveryAllocations += allocations;
+    }
+
+    void Messenger::Disconnect(const ConnectionPtr connection) {
+        if (!Threaded()) {
+            CloseConnection(connection, true);
+            return;
+        }
+        //Stop polling at once; the owner's own Remove for this connection is then a no-op.
+        poller.Remove(connection->socket);
+        polled.erase(connection->socket.get());
+        Emit({ Event::Type::Close, connection, {}, Clock::time_point() });
+    }
+
+    void Messenger::Emit(Event event) {
+        emitted = true;
+        if (eventBacklog.empty() && !events.Full()) {
+            events.Push(std::move(event));
+        } else {
+            eventBacklog.push_back(std::move(event));
+        }
+    }
+
+    void Messenger::EmitBacklog() {
+        while (!eventBacklog.empty() && !events.Full()) {
+            events.Push(std::move(eventBacklog.front()));
+            eventBacklog.pop_front();
+        }
     }
 
     void Messenger::CloseConnection(const ConnectionPtr connection, bool callback) {
         if (callback) {
             OnCloseConnection(connection);
         }
-        Remove(connection->socket, recvList);
-        Remove(connection->socket, sendList);
-        Remove(connection->socket, exceptList);
-        auto iter = std::find(connections.begin(), connections.end(), connection);
-        if (iter != connections.end()) {
-            connections.erase(iter);
-        }
+        connections.erase(connection->socket.get());
+        Post({ Operation::Type::Remove, connection, nullptr });
     }
-    
-    void Messenger::Remove(TCPSocketPtr socket, std::vector<TCPSocketPtr> &from) {
-        auto iter = std::find(from.begin(), from.end(), socket);
-        if (iter != from.end()) {
-            from.erase(iter);
-        }
+
+    ConnectionPtr Messenger::Find(const TCPSocketPtr &socket) const {
+        auto iter = connections.find(socket.get());
+        return iter != connections.end() ? iter->second : nullptr;
+    }
+
+    ConnectionPtr Messenger::FindPolled(const TCPSocketPtr &socket) const {
+        auto iter = polled.find(socket.get());
+        return iter != polled.end() ? iter->second : nullptr;
     }
-    
+
     void Messenger::Listen(std::shared_ptr<Network::SocketAddress> address) {
         std::shared_ptr<SocketAddress> addr = address != nullptr ? address : std::make_shared<SocketAddress>();
         listener = TCPSocket::Create();
         listener->Bind(*addr);
         listener->Listen();
         listener->Addr(*addr);
-        recvList.push_back(listener);
+        acceptor = listener;
+        //The listener accepts one connection per wake-up, so it stays level-triggered.
+        poller.Add(acceptor, false);
     }
 
     void Messenger::AddConnection(const ConnectionPtr connection) {
-        connections.push_back(connection);
-        recvList.push_back(connection->socket);
+        connections[connection->socket.get()] = connection;
+        Post({ Operation::Type::Add, connection, nullptr });
     }
 
-    void Messenger::Send(const ConnectionPtr connection) {
-        if (std::find(sendList.begin(), sendList.end(), connection->socket) == sendList.end()) {
-            sendList.push_back(connection->socket);
-        }
+    void Messenger::Send(const ConnectionPtr connection, Buffer buffer) {
+        connection->queued++;
+        Post({ Operation::Type::Send, connection, buffer });
     }
 
     void Messenger::CloseConnection(const ConnectionPtr connection) {
@@ -10,50 +10,149 @@
 #define Messenger_hpp
 
 #include <vector>
+#include <deque>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <unordered_map>
+#include "SPSCQueue.hpp"
 #include "Connection.hpp"
 
 namespace Messaging {
 
+    //Sockets are served on the owner's thread inside Update until StartThread is called.
+    //After that a dedicated I/O thread owns them: the owner posts operations and receives framed messages
+    //through lock-free queues, so socket work never waits for the game loop and the other way around.
     class Messenger {
-        std::vector<Network::TCPSocketPtr> recvList;
-        std::vector<Network::TCPSocketPtr> sendList;
-        std::vector<Network::TCPSocketPtr> exceptList;
+        typedef std::shared_ptr<const Network::OutputMemoryStream> Buffer;
+        typedef std::chrono::steady_clock Clock;
+        
+        //Owner to I/O thread.
+        struct Operation {
+            enum class Type {
+                Add,
+                Send,
+                Close,
+                Remove,
+                StopListening
+            };
+            
+            Type type;
+            ConnectionPtr connection;
+            Buffer buffer;
+        };
+        
+        //I/O thread to owner.
+        struct Event {
+            enum class Type {
+                Accept,
+                Message,
+                Close
+            };
+            
+            Type type;
+            ConnectionPtr connection;
+            std::vector<uint8_t> message;
+            //When the I/O side read the message off the socket.
+            Clock::time_point received;
+        };
+        
+        //I/O side state, only touched by the I/O thread while it runs.
+        Network::SocketPoller poller;
+        std::vector<Network::TCPSocketPtr> outRead;
+        std::vector<Network::TCPSocketPtr> outWrite;
+        //Connections with queued data that have not been written since the last flush.
+        std::vector<ConnectionPtr> pending;
+        std::unordered_map<const Network::TCPSocket *, ConnectionPtr> polled;
+        Network::TCPSocketPtr acceptor;
+        std::deque<Event> eventBacklog;
+        bool emitted;
+        
+        //Owner side state.
         Network::TCPSocketPtr listener;
-
+        Clock::time_point received;
+        std::deque<Operation> operationBacklog;
+        bool posted;
+        
+        //Set before the I/O thread starts and cleared after it is joined, so both sides may read it.
+        bool threaded;
+        std::thread thread;
+        std::atomic<bool> running;
+        std::atomic<bool> woken;
+        //Loopback pair that interrupts the I/O thread's wait when operations are posted.
+        Network::TCPSocketPtr wakeSender;
+        Network::TCPSocketPtr wakeReceiver;
+        SPSCQueue<Operation, 1024> operations;
+        SPSCQueue<Event, 1024> events;
+        //Message storage handed back by the owner once it has dispatched the message, so framing does not allocate.
+        SPSCQueue<std::vector<uint8_t>, 1024> recycled;
+        //Allocations the I/O thread made while framing messages; they stop once the pool covers the traffic.
+        std::atomic<uint64_t> deliveryAllocations;
+        std::function<void()> onEvents;
+        //Buffers put into the pool when the thread starts, and the message size each one is reserved for.
+        static const size_t pooledMessages;
+        static const size_t pooledMessageSize;
+    
     protected:
-        std::vector<ConnectionPtr> connections;
+        std::unordered_map<const Network::TCPSocket *, ConnectionPtr> connections;
         std::shared_ptr<Network::SocketAddress> address;
-        
+    
     public:
 		explicit Messenger();
         virtual ~Messenger() = 0;
         void Destroy();
 		void Cleanup();
         void Update(bool block = false);
+        //Writes everything queued since the last flush, or hands it to the I/O thread.
+        void Flush();
+        //Moves socket work to a dedicated thread; onEvents is called from it whenever Update has events to process.
+        void StartThread(std::function<void()> onEvents);
+        void StopThread();
         bool Destroyed() const { return connections.size() == 0 && listener == nullptr; }
+        //Safe from any thread; zero unless the I/O thread runs and allocations are counted.
+        uint64_t DeliveryAllocations() const { return deliveryAllocations; }
         std::string Address() const { return address->ToString(); }
-        
+    
     protected:
-        virtual void OnMessageRecv(const ConnectionPtr connection) {}
-        virtual void OnMessageSend(const ConnectionPtr connection) {}
-        virtual void OnNewConnection(const ConnectionPtr connection) {}
-        virtual void OnCloseConnection(const ConnectionPtr connection) {}
+        //Called once per Update before incoming data is processed.
+        virtual void OnUpdate() {}
+        //Called once per message, which is available in connection->input.
+        virtual void OnMessageRecv(const ConnectionPtr) {}
+        //When the message being handled was read off its socket, before it waited for the owner's thread.
+        Clock::time_point MessageTime() const { return received; }
+        virtual void OnNewConnection(const ConnectionPtr) {}
+        virtual void OnCloseConnection(const ConnectionPtr) {}
         virtual void OnDestroy() {}
         void Listen(std::shared_ptr<Network::SocketAddress> address = nullptr);
         void AddConnection(const ConnectionPtr connection);
-        void Send(const ConnectionPtr connection);
+        void Send(const ConnectionPtr connection, Buffer buffer);
         void CloseConnection(const ConnectionPtr connection);
         std::string ListenerAddress();
-        
+    
     private:
+        bool Threaded() const { return threaded; }
+        ConnectionPtr Find(const Network::TCPSocketPtr &socket) const;
+        void CloseConnection(const ConnectionPtr connection, bool callback);
+        void Post(Operation operation);
+        void Dispatch(Event &event);
+        void Wake();
+        void Run();
+        
+        //I/O side.
         void Read(const std::vector<Network::TCPSocketPtr> &outRead);
         void Write(const std::vector<Network::TCPSocketPtr> &outWrite);
-        void Except(const std::vector<Network::TCPSocketPtr> &outExcept);
-        void NewConnection(const std::vector<Network::TCPSocketPtr> &outRead);
-        void CloseConnection(const ConnectionPtr connection, bool callback);
-        void Remove(Network::TCPSocketPtr socket, std::vector<Network::TCPSocketPtr> &from);
+        void WritePending();
+        void Execute(Operation &operation);
+        void ExecuteOperations();
+        void Accept();
+        void Deliver(const ConnectionPtr connection);
+        void Disconnect(const ConnectionPtr connection);
+        void Emit(Event event);
+        void EmitBacklog();
+        ConnectionPtr FindPolled(const Network::TCPSocketPtr &socket) const;
     };
-    
+
 }
 
 #endif /* Messenger_hpp */
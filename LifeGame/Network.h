@@ -18,6 +18,7 @@
 #include "TCPSocket.hpp"
 #include "MemoryStream.hpp"
 #include "SocketSelector.hpp"
+#include "SocketPoller.hpp"
 
 namespace Network {
     
@@ -7,34 +7,79 @@
 //
 
 #include <cassert>
+#include <cmath>
+#include <algorithm>
 #include "Utils.hpp"
 #include "GameField.hpp"
 #include "Peer.hpp"
+#include "Allocations.hpp"
 
 using namespace Messaging;
 using namespace Network;
 using namespace Geometry;
 
-Peer::Peer(std::shared_ptr<GameField> gameField, int readyPlayers, int playersCount) :
-    gameField(gameField),
+const uint32_t Peer::ProtocolVersion = 8;
+const int Peer::pingInterval = 250;
+
+static uint64_t Timestamp(std::chrono::steady_clock::time_point time = std::chrono::steady_clock::now()) {
+    const auto sinceEpoch = time.time_since_epoch();
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(sinceEpoch).count());
+}
+
+Peer::Peer(std::shared_ptr<GameField> gameField, int readyPlayers, int playersCount, Topology topology) :
+    seed(0),
+    topology(topology),
+    spectator(false),
     readyPlayers(readyPlayers),
     playersCount(playersCount),
-    futureTurns(3),
-    seed(0),
-    pauseOnLastTurn(false),
     pause(false),
-    selfCommands(new CommandsQueue()) {
+    pauseOnLastTurn(false),
+    futureTurns(3),
+    targetTurns(0),
+    requestedTurns(0),
+    shrinkVotes(0),
+    nextPing(Clock::now()),
+    turn(0),
+    scheduledTurn(0),
+    scheduledTime(0),
+    masterTurn(0),
+    masterTime(0),
+    relayedTurns(0),
+    prediction(false),
+    predictedTurn(0),
+    snapshots(0),
+    rollbacks(0),
+    resimulatedTurns(0),
+    predictedTurns(0),
+    snapshotTime(Clock::duration::zero()),
+    predictionTime(Clock::duration::zero()),
+    report(false),
+    reportTurns(0),
+    stallTime(Clock::duration::zero()),
+    stalls(0),
+    inputLatency(Clock::duration::zero()),
+    worstInputLatency(Clock::duration::zero()),
+    inputs(0),
+    commandAllocations(0),
+    addedInputDelay(0),
+    selfCommands(std::make_shared<TurnQueue>()),
+    gameField(gameField) {
     gameField->SetPeer(this);
+    buffers.reserve(reservedBuffers);
+    for (size_t i = 0; i < reservedBuffers; i++) {
+        buffers.push_back(std::make_shared<OutputMemoryStream>(256));
+    }
 }
 
-Peer::Peer(std::shared_ptr<GameField> gameField, const std::string &address) :
-    Peer(gameField, 0, 0) {
+Peer::Peer(std::shared_ptr<GameField> gameField, const std::string &address, bool spectator) :
+    Peer(gameField, 0, 0, Topology::Mesh) {
+    this->spectator = spectator;
 	this->masterPeer = std::make_shared<Connection>(TCPSocket::Create());
     this->address = SocketAddress::CreateIPv4(address);
 }
 
-Peer::Peer(std::shared_ptr<GameField> gameField, int players) :
-    Peer(gameField, 1, players) {
+Peer::Peer(std::shared_ptr<GameField> gameField, int players, Topology topology) :
+    Peer(gameField, 1, players, topology) {
     address = std::make_shared<SocketAddress>();
     Listen(address);
     SetSeed(Random::NextUInt());
@@ -45,54 +90,189 @@ Peer::Peer(std::shared_ptr<GameField> gameField, int players) :
 }
 
 void Peer::Init() {
-    if (IsMaster()) return;
+    if (IsMaster()) {
+        StartProxy();
+        return;
+    }
     masterPeer->socket->Connect(*address);
     AddConnection(masterPeer);
-    Listen();
-    NewPlayerMessage().Write(this, masterPeer);
-    Send(masterPeer);
+    if (spectator) {
+        SpectateMessage().Write(this, masterPeer);
+    } else {
+        Listen();
+        StartProxy();
+        NewPlayerMessage().Write(this, masterPeer);
+    }
     do {
         Update(true);
     } while (!masterPeer->CanWrite());
-    do {
+    //The answer may have come in with the last write already, and then nothing else arrives until this peer answers.
+    while (!gameField->IsInitialized() && !Destroyed()) {
         Update(true);
-    } while (!masterPeer->CanRead());
-    assert(gameField->IsInitialized());
+    }
+    if (!gameField->IsInitialized()) {
+        throw std::runtime_error(spectator ? "Master peer refused the spectator!" : "Master peer refused the connection!");
+    }
 }
 
 void Peer::Turn() {
+    const Clock::time_point start = onTurn ? Clock::now() : Clock::time_point();
+    turn++;
+    if (report) {
+        MeasureTurn();
+    }
     if (CheckSync()) {
-        for (auto player : players) {
+        const bool predictable = IsPredictable();
+        const int delay = futureTurns;
+        bool applied = false;
+        for (const auto &player : players) {
+            if (!applied && player.first > gameField->Player()) {
+                ApplyCommand(selfCommands);
+                applied = true;
+            }
             ApplyCommand(player.second);
         }
-        ApplyCommand(selfCommands);
+        if (!applied) {
+            ApplyCommand(selfCommands);
+        }
+        if (relayedTurns > 0) {
+            relayedTurns--;
+        }
         gameField->ProcessUnits();
+        FeedSpectators();
+        UpdateInputDelay();
         PrepareCommands();
+        if (prediction) {
+            //A changed input delay skips or repeats a random draw, so the predicted turns can not be kept.
+            Predict(predictable && delay == futureTurns);
+        }
+        Flush();
+        if (onTurn) {
+            onTurn(turn, CalculateChecksum(), Clock::now() - start);
+        }
     } else {
         Log::Warning("Game instances are out of sync!");
         gameField->Destroy();
     }
 }
 
+Peer::Clock::time_point Peer::ScheduleTurn(Clock::time_point planned) {
+    scheduledTurn = turn;
+    scheduledTime = Timestamp(planned);
+    const int64_t turnTime = static_cast<int64_t>(gameField->TurnTime()) * 1000;
+    if (IsMaster() || turnTime == 0 || masterTime == 0 || !masterClock.IsSynchronized()) return planned;
+    //Turn n is due when the master runs it; a fraction of the error is corrected per turn, so the schedule slews instead of jumping.
+    const int64_t turns = static_cast<int64_t>(turn) - static_cast<int64_t>(masterTurn);
+    const int64_t due = static_cast<int64_t>(masterTime) - masterClock.Offset() + turns * turnTime;
+    const int64_t error = static_cast<int64_t>(scheduledTime) - due;
+    const int64_t maxSlew = turnTime / 8;
+    const int64_t slew = std::max(-maxSlew, std::min(error / 2, maxSlew));
+    scheduledTime -= slew;
+    return planned - std::chrono::microseconds(slew);
+}
+
 void Peer::Pause() {
+    if (spectator) return;
     pause = !pause;
     PauseMessage msg;
     BroadcastMessage(msg);
+    Flush();
 }
 
 void Peer::AddUnit(const Vector vector) {
     addedUnits.push_back(vector);
 }
 
-void Peer::AddPreset(const Geometry::Matrix3x3 &matrix, unsigned char preset) {
-    CommandPtr command = std::make_shared<AddPresetCommand>(matrix, preset, gameField->Player());
-    commands.push_back(command);
+void Peer::AddPreset(const Geometry::Transform &transform, unsigned char preset) {
+    addedPresets.push_back({ transform, preset, gameField->Player() });
+}
+
+void Peer::SetInputDelay(int turns) {
+    if (turns < 1 || turns > maxFutureTurns) {
+        Log::Warning("Peer", gameField->Player(), "ignores input delay of", turns, "turns");
+        return;
+    }
+    targetTurns = turns;
+    requestedTurns = 0;
+}
+
+void Peer::SetPrediction(bool enable) {
+    prediction = enable && !spectator;
+    predictedTurn = 0;
+}
+
+void Peer::SetImpairment(const ImpairmentProfile &profile) {
+    impairment = std::make_shared<ImpairmentProfile>(profile);
+    report = true;
+}
+
+void Peer::StartProxy() {
+    if (impairment == nullptr) return;
+    const std::string listenerAddress = ListenerAddress();
+    const std::string port = listenerAddress.substr(listenerAddress.find_last_of(':'));
+    proxy = std::make_shared<ImpairmentProxy>(*impairment, SocketAddress::CreateIPv4("127.0.0.1" + port));
+    proxy->Start();
+    Log::Warning("Connections to", listenerAddress, "go through", impairment->name, "link", proxy->Address());
+}
+
+std::string Peer::PublicAddress() {
+    return proxy != nullptr ? proxy->Address() : ListenerAddress();
+}
+
+void Peer::Stall() {
+    if (report && stalledSince == Clock::time_point()) {
+        stalledSince = Clock::now();
+    }
+}
+
+void Peer::MeasureTurn() {
+    const Clock::time_point now = Clock::now();
+    if (reportTime == Clock::time_point()) {
+        reportTime = now;
+    }
+    reportTurns++;
+    if (stalledSince != Clock::time_point()) {
+        stallTime += now - stalledSince;
+        stalls++;
+        stalledSince = Clock::time_point();
+    }
+    Clock::time_point &issued = issueTimes[turn % TurnQueue::capacity];
+    if (issued != Clock::time_point()) {
+        const Clock::duration latency = now - issued;
+        inputLatency += latency;
+        worstInputLatency = std::max(worstInputLatency, latency);
+        inputs++;
+        issued = Clock::time_point();
+    }
+    if (turn % networkReportTurns == 0) {
+        ReportNetwork(now);
+    }
+}
+
+void Peer::ReportNetwork(Clock::time_point now) {
+    typedef std::chrono::duration<double, std::milli> Milliseconds;
+    const double elapsed = Milliseconds(now - reportTime).count();
+    const double rate = elapsed > 0.0 ? reportTurns * 1000.0 / elapsed : 0.0;
+    const double latency = inputs > 0 ? Milliseconds(inputLatency).count() / inputs : 0.0;
+    Log::Warning("Peer", gameField->Player(), "network:", rate, "turns/s,", Milliseconds(stallTime).count(), "ms stalled in",
+                 stalls, "stalls,", latency, "ms input latency, worst", Milliseconds(worstInputLatency).count(), "ms");
+    reportTime = now;
+    reportTurns = 0;
+    stallTime = Clock::duration::zero();
+    stalls = 0;
+    inputLatency = Clock::duration::zero();
+    worstInputLatency = Clock::duration::zero();
+    inputs = 0;
+}
+
+const std::unordered_set<Unit> *Peer::PredictedUnits() const {
+    return prediction && predictedTurn > turn ? predicted.units.get() : nullptr;
 }
 
 bool Peer::IsPause() const {
     if (pause) return true;
-    typedef const std::unordered_map<int, CommandsQueuePtr>::value_type &value;
-    const auto emptyQueue = std::find_if(players.begin(), players.end(), [](value v){ return v.second->size() == 0; });
+    typedef const std::map<int, CommandsQueuePtr>::value_type &value;
+    const auto emptyQueue = std::find_if(players.begin(), players.end(), [](value v){ return v.second->Empty(); });
     const bool pause = emptyQueue != players.end();
     
     if (pause && !pauseOnLastTurn) {
@@ -104,38 +284,56 @@ bool Peer::IsPause() const {
     return pause;
 }
 
-void Peer::OnMessageRecv(const ConnectionPtr connection) {
-    for (int i = 0; i < connection->RecvMessages(); i++) {
-        std::shared_ptr<Message> msg = Message::Parse(connection->input);
-        if (msg == nullptr) {
-            CloseConnection(connection);
-            break;
-        } else {
-            msg->Read(this, connection);
-        }
-    }
-    connection->input.Clear();
+void Peer::OnUpdate() {
+    //Idle peers poll the network rarely, so only a running game gives round trips worth measuring.
+    if (ids.empty() || !IsGameStarted() || pause) return;
+    const Clock::time_point now = Clock::now();
+    if (now < nextPing) return;
+    nextPing = now + std::chrono::milliseconds(pingInterval);
+    PingMessage msg;
+    BroadcastMessage(msg);
 }
 
-void Peer::OnMessageSend(const ConnectionPtr connection) {
-    connection->output.Clear();
+void Peer::OnMessageRecv(const ConnectionPtr connection) {
+    AllocationScope scope(commandAllocations);
+    if (!Message::Receive(this, connection)) {
+        CloseConnection(connection);
+    }
 }
 
 void Peer::OnNewConnection(const ConnectionPtr connection) {
-    if (players.size() >= playersCount - 1) return;
+    //Whether it is a player or a spectator is only known from its first message.
+    if (players.size() >= static_cast<size_t>(playersCount - 1) && spectators.size() >= maxSpectators) return;
     AddConnection(connection);
 }
 
 void Peer::OnCloseConnection(const ConnectionPtr connection) {
+    if (spectators.erase(connection) > 0) return;
     if (ids.size() == 0 || !IsGameStarted()) {
         gameField->Destroy();
         return;
     }
+    if (topology == Topology::Star && connection == masterPeer) {
+        //Star players only reach each other through the master.
+        Log::Warning("Peer", gameField->Player(), "lost the relay");
+        gameField->Destroy();
+        return;
+    }
     const int id = ids[connection];
     ids.erase(connection);
     players.erase(id);
+    latency.erase(connection);
+    reportedLatency.erase(connection);
+    if (topology == Topology::Star) {
+        ClosePlayerMessage msg(id);
+        BroadcastMessage(msg);
+        //The closed player may have been the last one the next turn was waiting for.
+        RelayCommands();
+    }
     
     if (connection == masterPeer) {
+        masterClock.Reset();
+        masterTime = 0;
         typedef const std::unordered_map<ConnectionPtr, int>::value_type &value;
         auto min = std::min_element(ids.begin(), ids.end(), [](value v1, value v2){ return v1.second < v2.second; });
         if (min == ids.end() || min->second == gameField->Player()) {
@@ -150,25 +348,28 @@ void Peer::OnCloseConnection(const ConnectionPtr connection) {
 void Peer::OnDestroy() {
     players.clear();
     ids.clear();
+    latency.clear();
+    reportedLatency.clear();
+    spectators.clear();
     if (!IsMaster()) {
         masterPeer.reset();
     }
 }
 
 void Peer::AddPlayer(int id, const ConnectionPtr connection) {
-    players.emplace(id, std::make_shared<CommandsQueue>());
+    players.emplace(id, std::make_shared<TurnQueue>());
     ids.emplace(connection, id);
 }
 
 void Peer::AcceptNewPlayer(const ConnectionPtr connection) {
     AcceptPlayerMessage().Write(this, connection);
-    Send(connection);
 }
 
 void Peer::BroadcastMessage(Message &message) {
+    if (ids.empty()) return;
+    const auto buffer = message.Serialize(this);
     for (const auto &it : ids) {
-        message.Write(this, it.first);
-        Send(it.first);
+        Send(it.first, buffer);
     }
 }
 
@@ -181,53 +382,248 @@ void Peer::ConnectNewPlayer(const std::string &listenerAddress, int id) {
     AddConnection(newPlayer);
     AddPlayer(id, newPlayer);
     ConnectPlayerMessage().Write(this, newPlayer);
-    Send(newPlayer);
 }
 
 void Peer::CheckReadyForGame() {
     if (IsGameStarted()) return;
-    if (players.size() == playersCount - 1) {
+    if (players.size() == static_cast<size_t>(playersCount - 1)) {
         ReadyForGameMessage().Write(this, masterPeer);
-        Send(masterPeer);
     }
 }
 
 void Peer::ApplyCommand(CommandsQueuePtr queue) {
-    assert(queue->size() > 0);
-    queue->front()->Apply(gameField.get());
-    queue->pop();
+    assert(queue->Size() > 0);
+    queue->Front().Apply(gameField.get());
+    queue->Pop();
 }
 
 void Peer::StartGame() {
     for (auto player : players) {
-        assert(player.second->empty());
+        //A mesh peer that started first may have sent its first commands before the master's message reached this one.
         for (int i = 0; i < futureTurns; i++) {
-            player.second->push(std::make_shared<EmptyCommand>());
+            player.second->PushFront();
         }
     }
-    assert(selfCommands->empty());
+    assert(selfCommands->Empty());
     for (int i = 0; i < futureTurns; i++) {
-        selfCommands->push(std::make_shared<EmptyCommand>());
+        selfCommands->Next();
+        selfCommands->Push();
+    }
+    if (topology == Topology::Star) {
+        //Every peer starts with the same empty commands, so they never go through the relay.
+        relayedTurns = futureTurns;
     }
     assert(!IsPause());
     Log::Warning("Game started!");
 }
 
 void Peer::PrepareCommands() {
-    if (addedUnits.size() > 0) {
-        commands.emplace_back(std::make_shared<AddUnitsCommand>(gameField->Player(), std::move(addedUnits)));
+    AllocationScope scope(commandAllocations);
+    //Every peer reaches the same targetTurns on the same turn, so queues grow and shrink in step.
+    if (targetTurns > futureTurns) {
+        while (futureTurns < targetTurns) {
+            Command &command = selfCommands->Next();
+            selfCommands->Push();
+            SendCommand(command);
+            futureTurns++;
+        }
+        Log::Warning("Peer", gameField->Player(), "input delay is", futureTurns, "turns");
+    } else if (targetTurns != 0 && targetTurns < futureTurns) {
+        //Skipping a turn shortens every queue by one; pending units go out with the next command.
+        if (--futureTurns == targetTurns) {
+            Log::Warning("Peer", gameField->Player(), "input delay is", futureTurns, "turns");
+        }
+        return;
     }
-    const int32_t random = Random::Next();
+    targetTurns = 0;
+    const int32_t random = gameField->NextRandom();
     const uint64_t checksum = CalculateChecksum();
-    CommandPtr command = std::make_shared<ComplexCommand>(random, checksum, std::move(commands));
-    selfCommands->push(command);
-    CommandMessage msg;
+    Command &command = selfCommands->Next();
+    command.Reset(random, checksum);
+    for (const auto &preset : addedPresets) {
+        command.AddPreset(preset);
+    }
+    command.SetInputDelay(addedInputDelay);
+    if (addedUnits.size() > 0) {
+        command.SetUnits(gameField->Player(), addedUnits);
+    }
+    selfCommands->Push();
+    if (report) {
+        //Popped on the turn that many turns from now.
+        issueTimes[(turn + selfCommands->Size()) % TurnQueue::capacity] = Clock::now();
+    }
+    addedPresets.clear();
+    addedUnits.clear();
+    addedInputDelay = 0;
+    SendCommand(command);
+}
+
+void Peer::SendCommand(const Command &command) {
+    if (topology == Topology::Star && IsMaster()) {
+        RelayCommands();
+        return;
+    }
+    //A star player is only connected to the master, so this is a single upload.
+    CommandMessage msg(command);
     BroadcastMessage(msg);
 }
 
+void Peer::RelayCommands() {
+    if (topology != Topology::Star || !IsMaster()) return;
+    typedef const std::map<int, CommandsQueuePtr>::value_type &value;
+    const auto ready = [this](value v){ return v.second->Size() > relayedTurns; };
+    while (selfCommands->Size() > relayedTurns && std::all_of(players.begin(), players.end(), ready)) {
+        RelayMessage msg;
+        BroadcastMessage(msg);
+        relayedTurns++;
+    }
+}
+
+void Peer::FeedSpectators() {
+    if (spectators.empty()) {
+        spectatorFeed.Reset();
+        return;
+    }
+    const size_t cells = gameField->GetUnits()->size();
+    std::shared_ptr<const OutputMemoryStream> deltaBuffer;
+    std::shared_ptr<const OutputMemoryStream> keyframeBuffer;
+    if (spectatorFeed.Update(*gameField->GetUnits(), gameField->Generation())) {
+        deltaBuffer = DeltaMessage().Serialize(this);
+        //A keyframe takes at least a byte per cell, so it is only encoded when it may be the smaller frame.
+        if (deltaBuffer->Size() >= cells) {
+            keyframeBuffer = KeyframeMessage().Serialize(this);
+            if (keyframeBuffer->Size() <= deltaBuffer->Size()) {
+                deltaBuffer.reset();
+            }
+        }
+    }
+    for (auto &it : spectators) {
+        const ConnectionPtr &connection = it.first;
+        //A slow spectator loses frames rather than slowing the game; once it has caught up a keyframe resynchronizes it.
+        if (connection->Queued() >= maxSpectatorBacklog) {
+            if (it.second) {
+                Log::Warning("Spectator falls behind, it waits for a keyframe");
+                it.second = false;
+            }
+            continue;
+        }
+        if (!it.second && connection->Queued() > 0) continue;
+        if (it.second && deltaBuffer != nullptr) {
+            Send(connection, deltaBuffer);
+        } else {
+            if (keyframeBuffer == nullptr) {
+                keyframeBuffer = KeyframeMessage().Serialize(this);
+            }
+            Send(connection, keyframeBuffer);
+            it.second = true;
+        }
+    }
+}
+
+bool Peer::IsPredictable() const {
+    for (const auto &it : players) {
+        if (it.second->Front().ChangesField()) return false;
+    }
+    return true;
+}
+
+//Predicted turns are kept while the other players' commands turn out empty and checksums match.
+//Otherwise the confirmed field is copied and the own queued commands are replayed, at most one input delay of turns.
+void Peer::Predict(bool confirmed) {
+    const uint32_t capacity = Messaging::TurnQueue::capacity;
+    if (predictedTurn < turn || !confirmed || predictedChecksums[turn % capacity] != CalculateChecksum()) {
+        const Clock::time_point start = Clock::now();
+        gameField->SaveState(predicted);
+        snapshotTime += Clock::now() - start;
+        snapshots++;
+        if (predictedTurn > turn) {
+            rollbacks++;
+            resimulatedTurns += predictedTurn - turn;
+        }
+        predictedTurn = turn;
+    }
+    const Clock::time_point start = Clock::now();
+    gameField->SwapState(predicted);
+    while (predictedTurn < turn + selfCommands->Size()) {
+        selfCommands->At(predictedTurn - turn).ApplyUnits(gameField.get());
+        gameField->ProcessUnits();
+        //Stands for the random turn step the next command is going to take.
+        gameField->NextRandom();
+        predictedTurn++;
+        predictedChecksums[predictedTurn % capacity] = CalculateChecksum();
+        predictedTurns++;
+    }
+    gameField->SwapState(predicted);
+    predictionTime += Clock::now() - start;
+    if (turn % predictionReportTurns == 0) {
+        ReportPrediction();
+    }
+}
+
+void Peer::ReportPrediction() {
+    typedef std::chrono::duration<double, std::micro> Microseconds;
+    const double snapshot = snapshots > 0 ? Microseconds(snapshotTime).count() / snapshots : 0.0;
+    const double simulation = predictedTurns > 0 ? Microseconds(predictionTime).count() / predictedTurns : 0.0;
+    Log::Warning("Peer", gameField->Player(), "prediction:", rollbacks, "rollbacks,", resimulatedTurns, "turns simulated again,",
+                 snapshot, "us per snapshot,", simulation, "us per predicted turn");
+    snapshots = 0;
+    rollbacks = 0;
+    resimulatedTurns = 0;
+    predictedTurns = 0;
+    snapshotTime = Clock::duration::zero();
+    predictionTime = Clock::duration::zero();
+}
+
+std::shared_ptr<OutputMemoryStream> Peer::AcquireBuffer() {
+    for (const auto &buffer : buffers) {
+        //Only the pool holds it, so the I/O side is done with the previous message.
+        if (buffer.use_count() == 1) {
+            buffer->Clear();
+            return buffer;
+        }
+    }
+    buffers.push_back(std::make_shared<OutputMemoryStream>(256));
+    return buffers.back();
+}
+
+//The master picks the smallest delay that covers the worst round trip in the mesh, grows it at once
+//and shrinks it one turn at a time after the latency has stayed low for a while.
+void Peer::UpdateInputDelay() {
+    if (!IsMaster() || requestedTurns != 0 || targetTurns != 0) return;
+    const unsigned turnTime = gameField->TurnTime();
+    const double worst = WorstLatency();
+    if (turnTime == 0 || worst <= 0.0) return;
+    const int turns = static_cast<int>(std::ceil(worst / turnTime)) + 1;
+    const int desired = std::max(1, std::min(turns, static_cast<int>(maxFutureTurns)));
+    if (desired > futureTurns) {
+        requestedTurns = desired;
+    } else if (desired < futureTurns && ++shrinkVotes >= shrinkTurns) {
+        requestedTurns = futureTurns - 1;
+    }
+    if (desired >= futureTurns) {
+        shrinkVotes = 0;
+    }
+    if (requestedTurns != 0) {
+        shrinkVotes = 0;
+        addedInputDelay = requestedTurns;
+    }
+}
+
+double Peer::WorstLatency() const {
+    double result = 0.0;
+    for (const auto &it : latency) {
+        if (it.second.Samples() < minLatencySamples) continue;
+        result = std::max(result, it.second.Bound());
+    }
+    for (const auto &it : reportedLatency) {
+        result = std::max(result, it.second);
+    }
+    return result;
+}
+
 void Peer::SetSeed(uint32_t seed) {
     this->seed = seed;
-    Random::Seed(seed);
+    gameField->SetSeed(seed);
 }
 
 uint64_t Peer::CalculateChecksum() const {
@@ -243,11 +639,11 @@ uint64_t Peer::CalculateChecksum() const {
 }
 
 bool Peer::CheckSync() {
-	const CommandPtr command = selfCommands->front();
+	const Command &command = selfCommands->Front();
     for (const auto &it : players) {
-		const CommandPtr playerCommand = it.second->front();
-        if (command->TurnStep() != playerCommand->TurnStep() 
-			|| command->Checksum() != playerCommand->Checksum()) {
+		const Command &playerCommand = it.second->Front();
+        if (command.TurnStep() != playerCommand.TurnStep()
+			|| command.Checksum() != playerCommand.Checksum()) {
             return false;
         }
     }
@@ -258,25 +654,33 @@ bool Peer::CheckSync() {
 
 Peer::Message::~Message() {}
 
-std::shared_ptr<Peer::Message> Peer::Message::Parse(InputMemoryStream &stream) {
-    int32_t type;
-    stream.Read(type, stream.Size() + sizeof(uint32_t));
+bool Peer::Message::Receive(Peer *peer, const ConnectionPtr connection) {
+    uint8_t type;
+    connection->input.Read(type, connection->input.Position() + sizeof(uint32_t));
     switch (static_cast<Msg>(type)) {
-        case Msg::NewPlayer:     return std::make_shared<NewPlayerMessage>();
-        case Msg::AcceptPlayer:  return std::make_shared<AcceptPlayerMessage>();
-        case Msg::ConnectPlayer: return std::make_shared<ConnectPlayerMessage>();
-        case Msg::ReadyForGame:  return std::make_shared<ReadyForGameMessage>();
-        case Msg::Command:       return std::make_shared<CommandMessage>();
-        case Msg::Pause:         return std::make_shared<PauseMessage>();
+        case Msg::NewPlayer:     NewPlayerMessage().Read(peer, connection);     break;
+        case Msg::AcceptPlayer:  AcceptPlayerMessage().Read(peer, connection);  break;
+        case Msg::ConnectPlayer: ConnectPlayerMessage().Read(peer, connection); break;
+        case Msg::ReadyForGame:  ReadyForGameMessage().Read(peer, connection);  break;
+        case Msg::Command:       CommandMessage().Read(peer, connection);       break;
+        case Msg::Pause:         PauseMessage().Read(peer, connection);         break;
+        case Msg::Ping:          PingMessage().Read(peer, connection);          break;
+        case Msg::Pong:          PongMessage().Read(peer, connection);          break;
+        case Msg::Relay:         RelayMessage().Read(peer, connection);         break;
+        case Msg::ClosePlayer:   ClosePlayerMessage().Read(peer, connection);   break;
+        case Msg::Spectate:      SpectateMessage().Read(peer, connection);      break;
+        case Msg::Keyframe:      KeyframeMessage().Read(peer, connection);      break;
+        case Msg::Delta:         DeltaMessage().Read(peer, connection);         break;
         default:
             Log::Warning("Unknown message has been received!");
-            return nullptr;
+            return false;
     }
+    return true;
 }
 
 void Peer::Message::Read(Peer *peer, const ConnectionPtr connection) {
     uint32_t msgSize;
-    int32_t type;
+    uint8_t type;
     connection->input >> msgSize >> type;
     if (static_cast<Msg>(type) != Type()) {
         Log::Error("Messages types are not the same!");
@@ -285,18 +689,35 @@ void Peer::Message::Read(Peer *peer, const ConnectionPtr connection) {
     OnRead(peer, connection);
 }
 
-void Peer::Message::Write(Peer *peer, const ConnectionPtr connection) {
+std::shared_ptr<const OutputMemoryStream> Peer::Message::Serialize(Peer *peer) {
 //    Log::Warning("Peer", peer->gameField->Player(), "writes message of type", static_cast<int32_t>(Type()));
+    auto stream = peer->AcquireBuffer();
     uint32_t msgSize = 0;
-    uint32_t oldSize = connection->output.Size();
-    connection->output << msgSize << static_cast<int32_t>(Type());
-    OnWrite(peer, connection);
-    msgSize = connection->output.Size() - oldSize;
-    connection->output.Write(msgSize, oldSize);
+    *stream << msgSize << static_cast<uint8_t>(Type());
+    OnWrite(peer, *stream);
+    msgSize = stream->Size();
+    stream->Write(msgSize, 0);
+    return stream;
+}
+
+void Peer::Message::Write(Peer *peer, const ConnectionPtr connection) {
+    peer->Send(connection, Serialize(peer));
 }
 
 void Peer::NewPlayerMessage::OnRead(Peer *peer, const ConnectionPtr connection) {
     if (peer->IsMaster()) {
+        uint32_t version;
+        connection->input >> version;
+        if (version != ProtocolVersion) {
+            Log::Warning("Peer with protocol version", version, "can not join, expected", ProtocolVersion);
+            peer->CloseConnection(connection);
+            return;
+        }
+        if (peer->players.size() >= static_cast<size_t>(peer->playersCount - 1)) {
+            Log::Warning("Game is full, peer can not join");
+            peer->CloseConnection(connection);
+            return;
+        }
         SocketAddress address;
         connection->socket->Addr(address, true);
         std::string remoteAddress = address.ToString();
@@ -308,8 +729,10 @@ void Peer::NewPlayerMessage::OnRead(Peer *peer, const ConnectionPtr connection)
         port = listenerAddress.substr(listenerAddress.find_last_of(':'));
         std::string listenerRemoteAddress = host + port;
         int id = static_cast<int>(peer->players.size() + 1);
-        NewPlayerMessage msg(id, listenerRemoteAddress);
-        peer->BroadcastMessage(msg);
+        if (peer->topology == Topology::Mesh) {
+            NewPlayerMessage msg(id, listenerRemoteAddress);
+            peer->BroadcastMessage(msg);
+        }
         peer->AddPlayer(id, connection);
         peer->AcceptNewPlayer(connection);
     } else {
@@ -322,57 +745,65 @@ void Peer::NewPlayerMessage::OnRead(Peer *peer, const ConnectionPtr connection)
     }
 }
 
-void Peer::NewPlayerMessage::OnWrite(Peer *peer, const ConnectionPtr connection) {
+void Peer::NewPlayerMessage::OnWrite(Peer *peer, OutputMemoryStream &stream) {
     if (peer->IsMaster()) {
-        WriteAddress(connection->output, listenerAddress);
-        connection->output << static_cast<int32_t>(id);
+        WriteAddress(stream, listenerAddress);
+        stream << static_cast<int32_t>(id);
     } else {
-        WriteAddress(connection->output, peer->ListenerAddress());
+        stream << ProtocolVersion;
+        WriteAddress(stream, peer->PublicAddress());
     }
 }
 
 void Peer::NewPlayerMessage::ReadAddress(InputMemoryStream &stream, std::string &address) {
     uint32_t size;
     stream >> size;
-    address.resize(size);
-    for (int i = 0; i < size; i++) {
-        uint8_t symbol;
-        stream >> symbol;
-        address[i] = static_cast<char>(symbol);
+    if (size > stream.Remaining()) {
+        throw std::out_of_range("Not enough data!");
     }
+    address.resize(size);
+    stream.ReadArray(reinterpret_cast<uint8_t *>(&address[0]), size);
 }
 
 void Peer::NewPlayerMessage::WriteAddress(OutputMemoryStream &stream, const std::string &address) {
     stream << static_cast<uint32_t>(address.size());
-    for (int i = 0; i < address.size(); i++) {
-        stream << static_cast<uint8_t>(address[i]);
-    }
+    stream.WriteArray(reinterpret_cast<const uint8_t *>(address.data()), static_cast<uint32_t>(address.size()));
 }
 
 void Peer::AcceptPlayerMessage::OnRead(Peer *peer, const ConnectionPtr connection) {
     int32_t playersCount, x, y, id, masterId;
     uint32_t turnTime, seed;
-    connection->input >> playersCount >> x >> y >> id >> masterId >> turnTime >> seed;
+    uint8_t topology;
+    connection->input >> playersCount >> x >> y >> id >> masterId >> turnTime >> seed >> topology;
     peer->playersCount = static_cast<int>(playersCount);
+    peer->topology = static_cast<Topology>(topology);
     
     peer->gameField->SetSize(Vector(static_cast<int>(x), static_cast<int>(y)));
     peer->gameField->SetPlayer(static_cast<int>(id));
     peer->gameField->SetTurnTime(static_cast<unsigned>(turnTime));
+    if (peer->topology == Topology::Star) {
+        //Other players are only known by their ids; their commands arrive relayed by the master.
+        for (int other = 0; other < peer->playersCount; other++) {
+            if (other == id || other == masterId) continue;
+            peer->players.emplace(other, std::make_shared<TurnQueue>());
+        }
+    }
     peer->AddPlayer(static_cast<int>(masterId), connection);
     peer->CheckReadyForGame();
     peer->SetSeed(seed);
     assert(peer->gameField->Player() >= 0 && peer->gameField->Player() < peer->playersCount);
 }
 
-void Peer::AcceptPlayerMessage::OnWrite(Peer *peer, const ConnectionPtr connection) {
-    connection->output
+void Peer::AcceptPlayerMessage::OnWrite(Peer *peer, OutputMemoryStream &stream) {
+    stream
     << static_cast<int32_t>(peer->playersCount)
     << static_cast<int32_t>(peer->gameField->GetSize().x)
     << static_cast<int32_t>(peer->gameField->GetSize().y)
     << static_cast<int32_t>(peer->players.size())
     << static_cast<int32_t>(peer->gameField->Player())
     << static_cast<uint32_t>(peer->gameField->TurnTime())
-    << peer->seed;
+    << peer->seed
+    << static_cast<uint8_t>(peer->topology);
 }
 
 void Peer::ConnectPlayerMessage::OnRead(Peer *peer, const ConnectionPtr connection) {
@@ -382,8 +813,8 @@ void Peer::ConnectPlayerMessage::OnRead(Peer *peer, const ConnectionPtr connecti
     peer->CheckReadyForGame();
 }
 
-void Peer::ConnectPlayerMessage::OnWrite(Peer *peer, const ConnectionPtr connection) {
-    connection->output << static_cast<int32_t>(peer->gameField->Player());
+void Peer::ConnectPlayerMessage::OnWrite(Peer *peer, OutputMemoryStream &stream) {
+    stream << static_cast<int32_t>(peer->gameField->Player());
     peer->CheckReadyForGame();
 }
 
@@ -391,7 +822,8 @@ void Peer::ReadyForGameMessage::OnRead(Peer *peer, const ConnectionPtr connectio
     int32_t playersSize, playersCount, readyPlayers;
     connection->input >> playersSize >> playersCount >> readyPlayers;
     assert(playersCount == peer->playersCount);
-    assert(playersSize == peer->players.size());
+    //Star players are ready as soon as the master accepts them, before the others have joined.
+    assert(static_cast<size_t>(playersSize) == peer->players.size() || peer->topology == Topology::Star);
     
     if (peer->IsMaster()) {
         assert(readyPlayers == 0);
@@ -408,44 +840,192 @@ void Peer::ReadyForGameMessage::OnRead(Peer *peer, const ConnectionPtr connectio
     }
 }
 
-void Peer::ReadyForGameMessage::OnWrite(Peer *peer, const ConnectionPtr connection) {
-    assert(peer->playersCount == peer->players.size() + 1);
-    connection->output
+void Peer::ReadyForGameMessage::OnWrite(Peer *peer, OutputMemoryStream &stream) {
+    assert(static_cast<size_t>(peer->playersCount) == peer->players.size() + 1);
+    stream
     << static_cast<int32_t>(peer->players.size())
     << static_cast<int32_t>(peer->playersCount)
     << static_cast<int32_t>(peer->readyPlayers);
-    
-    if (!peer->IsMaster()) {
-        assert(connection == peer->masterPeer);
-    }
 }
 
 void Peer::CommandMessage::OnRead(Peer *peer, const Messaging::ConnectionPtr connection) {
-    int32_t id;
-    connection->input >> id;
-    CommandPtr command = Command::Parse(connection->input);
-    if (command != nullptr) {
-        const int key = static_cast<int>(id);
-        auto player = peer->players.find(key);
-        if (player != peer->players.end()) {
-//            Log::Warning("Command recv", id, command->TurnStep());
-            player->second->push(command);
-        }
-    }
+    const uint64_t id = connection->input.ReadVarint();
+    auto player = peer->players.find(static_cast<int>(id));
+    if (player == peer->players.end()) return;
+    //Decoded straight into the queue slot, which is only committed once the whole command has been read.
+    Command &command = player->second->Next();
+    command.Read(connection->input, peer->gameField->GetSize());
+    player->second->Push();
+    peer->RelayCommands();
+//    Log::Warning("Command recv", id, command.TurnStep());
 }
 
-void Peer::CommandMessage::OnWrite(Peer *peer, const Messaging::ConnectionPtr connection) {
-    connection->output << static_cast<int32_t>(peer->gameField->Player());
-    peer->selfCommands->back()->Write(connection->output);
-//    Log::Warning("Command send", peer->gameField->Player(), peer->selfCommands->back()->TurnStep());
+void Peer::CommandMessage::OnWrite(Peer *peer, OutputMemoryStream &stream) {
+    stream.WriteVarint(static_cast<uint64_t>(peer->gameField->Player()));
+    command->Write(stream);
+//    Log::Warning("Command send", peer->gameField->Player(), command->TurnStep());
 }
 
 void Peer::PauseMessage::OnRead(Peer *peer, const Messaging::ConnectionPtr connection) {
     bool pause;
     connection->input >> pause;
     peer->pause = pause;
+    if (peer->topology == Topology::Star && peer->IsMaster()) {
+        const auto buffer = Serialize(peer);
+        for (const auto &it : peer->ids) {
+            if (it.first != connection) {
+                peer->Send(it.first, buffer);
+            }
+        }
+    }
+}
+
+void Peer::PauseMessage::OnWrite(Peer *peer, OutputMemoryStream &stream) {
+    stream << peer->pause;
+}
+
+void Peer::PingMessage::OnRead(Peer *peer, const Messaging::ConnectionPtr connection) {
+    uint64_t timestamp;
+    connection->input >> timestamp;
+    //The pong reports how long the ping waited here, so a busy turn does not count as network latency.
+    PongMessage(timestamp, Timestamp(peer->MessageTime())).Write(peer, connection);
+}
+
+void Peer::PingMessage::OnWrite(Peer *, OutputMemoryStream &stream) {
+    stream << Timestamp();
+}
+
+void Peer::PongMessage::OnRead(Peer *peer, const Messaging::ConnectionPtr connection) {
+    uint64_t remoteTime, scheduledTime;
+    uint32_t scheduledTurn;
+    connection->input >> timestamp >> pingReceived >> remoteTime >> scheduledTurn >> scheduledTime;
+    const uint64_t reported = connection->input.ReadVarint();
+    if (peer->ids.count(connection) == 0) return;
+    const uint64_t now = Timestamp(peer->MessageTime());
+    const uint64_t held = remoteTime >= pingReceived ? remoteTime - pingReceived : 0;
+    if (timestamp + held <= now) {
+        peer->latency[connection].AddSample(static_cast<double>(now - timestamp - held) / 1000.0);
+    }
+    peer->reportedLatency[connection] = static_cast<double>(reported) / 1000.0;
+    if (connection == peer->masterPeer) {
+        peer->masterClock.AddSample(timestamp, pingReceived, remoteTime, now);
+        peer->masterTurn = scheduledTurn;
+        peer->masterTime = scheduledTime;
+    }
+}
+
+void Peer::PongMessage::OnWrite(Peer *peer, OutputMemoryStream &stream) {
+    stream << timestamp << pingReceived << Timestamp() << peer->scheduledTurn << peer->scheduledTime;
+    stream.WriteVarint(static_cast<uint64_t>(peer->WorstLatency() * 1000.0));
+}
+
+
+void Peer::RelayMessage::OnRead(Peer *peer, const Messaging::ConnectionPtr connection) {
+    const uint64_t count = connection->input.ReadVarint();
+    for (uint64_t i = 0; i < count; i++) {
+        const int id = static_cast<int>(connection->input.ReadVarint());
+        auto player = peer->players.find(id);
+        if (player == peer->players.end()) {
+            //Our own command, or one of a player that has already left.
+            peer->relayedCommand.Read(connection->input, peer->gameField->GetSize());
+            continue;
+        }
+        Command &command = player->second->Next();
+        command.Read(connection->input, peer->gameField->GetSize());
+        player->second->Push();
+    }
+}
+
+void Peer::RelayMessage::OnWrite(Peer *peer, OutputMemoryStream &stream) {
+    //Serialized once for all players, so each one finds its own command among the others.
+    stream.WriteVarint(static_cast<uint64_t>(peer->players.size() + 1));
+    stream.WriteVarint(static_cast<uint64_t>(peer->gameField->Player()));
+    peer->selfCommands->At(peer->relayedTurns).Write(stream);
+    for (const auto &it : peer->players) {
+        stream.WriteVarint(static_cast<uint64_t>(it.first));
+        it.second->At(peer->relayedTurns).Write(stream);
+    }
+}
+
+void Peer::ClosePlayerMessage::OnRead(Peer *peer, const Messaging::ConnectionPtr connection) {
+    int32_t id;
+    connection->input >> id;
+    peer->players.erase(static_cast<int>(id));
+    Log::Warning("Peer", id, "left the game");
+}
+
+void Peer::ClosePlayerMessage::OnWrite(Peer *, OutputMemoryStream &stream) {
+    stream << static_cast<int32_t>(id);
+}
+
+void Peer::SpectateMessage::OnRead(Peer *peer, const Messaging::ConnectionPtr connection) {
+    uint32_t version;
+    connection->input >> version;
+    if (version != ProtocolVersion || !peer->IsMaster() || peer->spectators.size() >= maxSpectators) {
+        Log::Warning("Spectator with protocol version", version, "is refused");
+        peer->CloseConnection(connection);
+        return;
+    }
+    peer->spectators[connection] = true;
+    KeyframeMessage().Write(peer, connection);
+}
+
+void Peer::SpectateMessage::OnWrite(Peer *, OutputMemoryStream &stream) {
+    stream << ProtocolVersion;
+}
+
+void Peer::KeyframeMessage::OnRead(Peer *peer, const Messaging::ConnectionPtr connection) {
+    int32_t x, y;
+    uint32_t turnTime, generation;
+    connection->input >> x >> y >> turnTime >> generation;
+    const Vector size(static_cast<int>(x), static_cast<int>(y));
+    if (size.x <= 0 || size.y <= 0) {
+        Log::Error("Wrong spectated field size!");
+    }
+    SpectatorFeed::ReadUnits(connection->input, peer->spectatedUnits, size);
+    GameField *gameField = peer->gameField.get();
+    gameField->SetSize(size);
+    gameField->SetTurnTime(static_cast<unsigned>(turnTime));
+    if (gameField->Player() < 0) {
+        gameField->SetPlayer(0);
+    }
+    gameField->ClearUnits();
+    for (const auto &unit : peer->spectatedUnits) {
+        gameField->AddUnit(unit.position, unit.player);
+    }
+    gameField->SetGeneration(generation);
+}
+
+void Peer::KeyframeMessage::OnWrite(Peer *peer, OutputMemoryStream &stream) {
+    const Vector size = peer->gameField->GetSize();
+    stream
+    << static_cast<int32_t>(size.x)
+    << static_cast<int32_t>(size.y)
+    << static_cast<uint32_t>(peer->gameField->TurnTime())
+    << peer->gameField->Generation();
+    peer->spectatorFeed.WriteKeyframe(stream, *peer->gameField->GetUnits(), size);
+}
+
+void Peer::DeltaMessage::OnRead(Peer *peer, const Messaging::ConnectionPtr connection) {
+    uint32_t generation;
+    connection->input >> generation;
+    GameField *gameField = peer->gameField.get();
+    if (!gameField->IsInitialized()) {
+        Log::Error("Delta has been received before a keyframe!");
+    }
+    SpectatorFeed::ReadUnits(connection->input, peer->spectatedUnits, gameField->GetSize());
+    for (const auto &unit : peer->spectatedUnits) {
+        gameField->RemoveUnit(unit.position);
+    }
+    SpectatorFeed::ReadUnits(connection->input, peer->spectatedUnits, gameField->GetSize());
+    for (const auto &unit : peer->spectatedUnits) {
+        gameField->RemoveUnit(unit.position);
+        gameField->AddUnit(unit.position, unit.player);
+    }
+    gameField->SetGeneration(generation);
 }
 
-void Peer::PauseMessage::OnWrite(Peer *peer, const Messaging::ConnectionPtr connection) {
-    connection->output << peer->pause;
+void Peer::DeltaMessage::OnWrite(Peer *peer, OutputMemoryStream &stream) {
+    stream << peer->gameField->Generation();
+    peer->spectatorFeed.WriteDelta(stream, peer->gameField->GetSize());
 }
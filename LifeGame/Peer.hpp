@@ -10,55 +10,180 @@
 #define Peer_hpp
 
 #include <string>
-#include <queue>
+#include <chrono>
+#include <map>
 #include <unordered_map>
 #include "Geometry.h"
+#include "GameField.hpp"
 #include "Messenger.hpp"
-#include "Command.hpp"
+#include "TurnQueue.hpp"
+#include "LatencyMeter.hpp"
+#include "ClockSync.hpp"
+#include "SpectatorFeed.hpp"
+#include "ImpairmentProxy.hpp"
 
 class Peer : public Messaging::Messenger {
-    typedef std::shared_ptr<Messaging::Command> CommandPtr;
-    typedef std::queue<CommandPtr> CommandsQueue;
-    typedef std::shared_ptr<CommandsQueue> CommandsQueuePtr;
+public:
+    //Mesh connects every pair of players. Star routes everything through the master, which relays
+    //each turn's commands to all players in one message, so a player uploads its commands only once.
+    enum class Topology : uint8_t {
+        Mesh,
+        Star
+    };
+    
+private:
+    //Bumped whenever the wire format changes; joining peers have to match the master.
+    const static uint32_t ProtocolVersion;
+    
+    typedef std::shared_ptr<Messaging::TurnQueue> CommandsQueuePtr;
+    typedef std::chrono::steady_clock Clock;
+    
+    const static int maxFutureTurns = 16;
+    static_assert(Messaging::TurnQueue::capacity >= 2 * (maxFutureTurns + 1), "Turn queues have to hold two input delays!");
+    //Turns the measured latency has to stay low before the input delay shrinks by a turn.
+    const static int shrinkTurns = 40;
+    const static int pingInterval;
+    //Round trips measured on a link before it is trusted.
+    const static uint32_t minLatencySamples = 4;
+    const static size_t maxSpectators = 256;
+    //Turns between reports of the prediction costs.
+    const static uint32_t predictionReportTurns = 100;
+    //Frames a spectator may have in flight before it is skipped until it can take a keyframe.
+    const static uint32_t maxSpectatorBacklog = 8;
+    //Turns between reports of the turn rate, stalls and input latency.
+    const static uint32_t networkReportTurns = 100;
+    //Serialized messages usually in flight at once, each command and ping among them, so the pool starts this big.
+    const static size_t reservedBuffers = 16;
     
     uint32_t seed;
+    Topology topology;
+    //Mirrors the master's field from frames instead of taking part in the lockstep.
+    bool spectator;
     int readyPlayers;
     int playersCount;
     bool pause;
     mutable bool pauseOnLastTurn;
-    const int futureTurns;
+    //Turns between issuing a command and applying it. Only changed by a command's input delay, so all peers agree.
+    int futureTurns;
+    //Input delay applied by the last command that has not been reached yet, 0 if none.
+    int targetTurns;
+    //Master only: input delay requested and not yet applied, 0 if none.
+    int requestedTurns;
+    int shrinkVotes;
+    Clock::time_point nextPing;
+    //Turns applied so far; every peer counts the same turns.
+    uint32_t turn;
+    //Local time in microseconds at which turn scheduledTurn is due.
+    uint32_t scheduledTurn;
+    uint64_t scheduledTime;
+    //The master's schedule in its own clock, as reported by its last pong.
+    uint32_t masterTurn;
+    uint64_t masterTime;
+    Messaging::ClockSync masterClock;
+    //Star master only: commands at the front of every queue that have already been relayed.
+    uint32_t relayedTurns;
+    //Star player only: a relayed command of its own is decoded here and dropped.
+    Messaging::Command relayedCommand;
+    //Master only: spectators are not players, so they never hold up a turn. False until the next keyframe.
+    std::unordered_map<Messaging::ConnectionPtr, bool> spectators;
+    Messaging::SpectatorFeed spectatorFeed;
+    //Spectator only: cells decoded from the last frame.
+    std::vector<Unit> spectatedUnits;
+    
+    //Runs the field ahead of the confirmed turn with the player's own commands and empty commands of everyone else.
+    bool prediction;
+    //Field as it will be after turn predictedTurn, if the other players issue nothing until then.
+    GameField::State predicted;
+    uint32_t predictedTurn;
+    //Checksums of the predicted turns, checked against the confirmed ones.
+    uint64_t predictedChecksums[Messaging::TurnQueue::capacity];
+    uint32_t snapshots;
+    uint32_t rollbacks;
+    uint32_t resimulatedTurns;
+    uint32_t predictedTurns;
+    Clock::duration snapshotTime;
+    Clock::duration predictionTime;
+    
+    //Reports how the lockstep copes with the network: turns per second, time spent waiting for commands and input latency.
+    bool report;
+    Clock::time_point reportTime;
+    uint32_t reportTurns;
+    //Set when a turn is due and some player's commands are missing.
+    Clock::time_point stalledSince;
+    Clock::duration stallTime;
+    uint32_t stalls;
+    //When each of the player's queued commands was issued, by the turn it applies at.
+    Clock::time_point issueTimes[Messaging::TurnQueue::capacity];
+    Clock::duration inputLatency;
+    Clock::duration worstInputLatency;
+    uint32_t inputs;
+    //Other peers reach this one through the proxy, so every link to it is impaired.
+    std::shared_ptr<Network::ImpairmentProfile> impairment;
+    std::shared_ptr<Network::ImpairmentProxy> proxy;
+    std::function<void(uint32_t, uint64_t, Clock::duration)> onTurn;
+    //Heap allocations made while handling messages and preparing commands; a running game does not need any.
+    uint64_t commandAllocations;
     
     Messaging::ConnectionPtr masterPeer;
-    std::unordered_map<int, CommandsQueuePtr> players;
+    //Ordered by id: commands are applied in the same order on every peer, so the first of two units added to one cell wins everywhere.
+    std::map<int, CommandsQueuePtr> players;
     std::unordered_map<Messaging::ConnectionPtr, int> ids;
+    std::unordered_map<Messaging::ConnectionPtr, Messaging::LatencyMeter> latency;
+    //Worst latency bound, in milliseconds, that each peer measured on its own links.
+    std::unordered_map<Messaging::ConnectionPtr, double> reportedLatency;
     
-    std::vector<CommandPtr> commands;
+    //Input gathered since the last turn; cleared rather than released, so the storage is reused.
+    std::vector<Messaging::Command::Preset> addedPresets;
+    std::vector<Geometry::Vector> addedUnits;
+    int addedInputDelay;
     CommandsQueuePtr selfCommands;
     std::shared_ptr<class GameField> gameField;
-    std::vector<Geometry::Vector> addedUnits;
+    //Serialized messages are recycled once the I/O side has released them.
+    std::vector<std::shared_ptr<Network::OutputMemoryStream>> buffers;
     
 public:
-    explicit Peer(std::shared_ptr<GameField> gameField, const std::string &address);
-    explicit Peer(std::shared_ptr<GameField> gameField, int players);
+    explicit Peer(std::shared_ptr<GameField> gameField, const std::string &address, bool spectator = false);
+    explicit Peer(std::shared_ptr<GameField> gameField, int players, Topology topology = Topology::Mesh);
     virtual ~Peer() override {}
     
     void Init();
     void Turn();
+    //Takes the time the next turn is planned at and returns it slewed towards the master's schedule.
+    Clock::time_point ScheduleTurn(Clock::time_point planned);
     void Pause();
     void AddUnit(const Geometry::Vector vector);
-    void AddPreset(const Geometry::Matrix3x3 &matrix, unsigned char preset);
+    void AddPreset(const Geometry::Transform &transform, unsigned char preset);
+    void SetInputDelay(int turns);
+    //Shows the local player's commands when they are issued instead of input delay turns later.
+    void SetPrediction(bool enable);
+    //Units to show instead of the confirmed field, nullptr if nothing is predicted.
+    const std::unordered_set<Unit> *PredictedUnits() const;
+    //Puts a proxy with the profile in front of the listener and turns the network report on; has to be called before Init.
+    void SetImpairment(const Network::ImpairmentProfile &profile);
+    void SetReport(bool enable) { report = enable; }
+    //Called after every turn with its number, the checksum of the field and how long the turn took.
+    void SetTurnCallback(std::function<void(uint32_t, uint64_t, Clock::duration)> onTurn) { this->onTurn = onTurn; }
+    //Read on the thread that runs the game, for example in the turn callback; includes the I/O thread's framing.
+    uint64_t CommandAllocations() const { return commandAllocations + DeliveryAllocations(); }
+    //Called instead of Turn while the turn is held up by missing commands.
+    void Stall();
+    //Address other peers connect to, the proxy's if there is one.
+    std::string PublicAddress();
     bool IsPause() const;
-    bool IsGameStarted() const { return playersCount == readyPlayers; }
+    bool IsPaused() const { return pause; }
+    //Turns between issuing a command and applying it.
+    int InputDelay() const { return futureTurns; }
+    bool IsGameStarted() const { return !spectator && playersCount == readyPlayers; }
     
 protected:
+    virtual void OnUpdate() override;
     virtual void OnMessageRecv(const Messaging::ConnectionPtr connection) override;
-    virtual void OnMessageSend(const Messaging::ConnectionPtr connection) override;
     virtual void OnNewConnection(const Messaging::ConnectionPtr connection) override;
     virtual void OnCloseConnection(const Messaging::ConnectionPtr connection) override;
     virtual void OnDestroy() override;
     
 private:
-    explicit Peer(std::shared_ptr<GameField> gameField, int readyPlayers, int playersCount);
+    explicit Peer(std::shared_ptr<GameField> gameField, int readyPlayers, int playersCount, Topology topology);
     bool IsMaster() const { return masterPeer == nullptr; }
     
     struct Message;
@@ -71,6 +196,18 @@ private:
     void ApplyCommand(CommandsQueuePtr queue);
     void StartGame();
     void PrepareCommands();
+    void SendCommand(const Messaging::Command &command);
+    void RelayCommands();
+    void FeedSpectators();
+    bool IsPredictable() const;
+    void Predict(bool confirmed);
+    void ReportPrediction();
+    void StartProxy();
+    void MeasureTurn();
+    void ReportNetwork(Clock::time_point now);
+    std::shared_ptr<Network::OutputMemoryStream> AcquireBuffer();
+    void UpdateInputDelay();
+    double WorstLatency() const;
     void SetSeed(uint32_t seed);
     uint64_t CalculateChecksum() const;
     bool CheckSync();
@@ -82,7 +219,7 @@ private:
         virtual ~newMsg##Message() override {}                                               \
         virtual Msg Type() override { return msgType; }                                      \
     private:                                                                                 \
-        virtual void OnWrite(Peer *peer, const Messaging::ConnectionPtr connection) override;\
+        virtual void OnWrite(Peer *peer, Network::OutputMemoryStream &stream) override;      \
         virtual void OnRead(Peer *peer, const Messaging::ConnectionPtr connection) override; \
     };
     #endif
@@ -94,19 +231,29 @@ private:
             ConnectPlayer,
             ReadyForGame,
             Command,
-            Pause
+            Pause,
+            Ping,
+            Pong,
+            Relay,
+            ClosePlayer,
+            Spectate,
+            Keyframe,
+            Delta
         };
         
-        static std::shared_ptr<Message> Parse(Network::InputMemoryStream &stream);
+        //Reads the message in connection->input with a message object on the stack; false for unknown types.
+        static bool Receive(Peer *peer, const Messaging::ConnectionPtr connection);
         
         virtual ~Message() = 0;
         virtual Msg Type() = 0;
         
+        //Serializes the message once; the buffer can be queued on any number of connections.
+        std::shared_ptr<const Network::OutputMemoryStream> Serialize(Peer *peer);
         void Write(Peer *peer, const Messaging::ConnectionPtr connection);
         void Read(Peer *peer, const Messaging::ConnectionPtr connection);
         
     private:
-        virtual void OnWrite(Peer *peer, const Messaging::ConnectionPtr connection) = 0;
+        virtual void OnWrite(Peer *peer, Network::OutputMemoryStream &stream) = 0;
         virtual void OnRead(Peer *peer, const Messaging::ConnectionPtr connection) = 0;
     };
     
@@ -123,17 +270,76 @@ private:
         virtual Msg Type() override { return Msg::NewPlayer; }
         
     private:
-        virtual void OnWrite(Peer *peer, const Messaging::ConnectionPtr connection) override;
+        virtual void OnWrite(Peer *peer, Network::OutputMemoryStream &stream) override;
         virtual void OnRead(Peer *peer, const Messaging::ConnectionPtr connection) override;
         void ReadAddress(Network::InputMemoryStream &stream, std::string &address);
         void WriteAddress(Network::OutputMemoryStream &stream, const std::string &address);
     };
     
+    struct CommandMessage : public Message {
+    private:
+        const Messaging::Command *command;
+        
+    public:
+        CommandMessage() : command(nullptr) {}
+        explicit CommandMessage(const Messaging::Command &command) : command(&command) {}
+        
+        virtual ~CommandMessage() override {}
+        virtual Msg Type() override { return Msg::Command; }
+        
+    private:
+        virtual void OnWrite(Peer *peer, Network::OutputMemoryStream &stream) override;
+        virtual void OnRead(Peer *peer, const Messaging::ConnectionPtr connection) override;
+    };
+    
+    //Echoes the timestamp of a ping with the sender's clock when the ping was read off the socket and when the pong is written,
+    //its turn schedule and the worst latency it sees on its links.
+    struct PongMessage : public Message {
+    private:
+        uint64_t timestamp;
+        uint64_t pingReceived;
+        
+    public:
+        PongMessage() : timestamp(0), pingReceived(0) {}
+        explicit PongMessage(uint64_t timestamp, uint64_t pingReceived) : timestamp(timestamp), pingReceived(pingReceived) {}
+        
+        virtual ~PongMessage() override {}
+        virtual Msg Type() override { return Msg::Pong; }
+        
+    private:
+        virtual void OnWrite(Peer *peer, Network::OutputMemoryStream &stream) override;
+        virtual void OnRead(Peer *peer, const Messaging::ConnectionPtr connection) override;
+    };
+    
+    //Tells star players that a player has left the game.
+    struct ClosePlayerMessage : public Message {
+    private:
+        int id;
+        
+    public:
+        ClosePlayerMessage() : id(0) {}
+        explicit ClosePlayerMessage(int id) : id(id) {}
+        
+        virtual ~ClosePlayerMessage() override {}
+        virtual Msg Type() override { return Msg::ClosePlayer; }
+        
+    private:
+        virtual void OnWrite(Peer *peer, Network::OutputMemoryStream &stream) override;
+        virtual void OnRead(Peer *peer, const Messaging::ConnectionPtr connection) override;
+    };
+    
     MESSAGE(AcceptPlayer, Msg::AcceptPlayer)
     MESSAGE(ConnectPlayer, Msg::ConnectPlayer)
     MESSAGE(ReadyForGame, Msg::ReadyForGame)
-    MESSAGE(Command, Msg::Command)
     MESSAGE(Pause, Msg::Pause)
+    MESSAGE(Ping, Msg::Ping)
+    //Every player's command for the next turn the star master has not relayed yet.
+    MESSAGE(Relay, Msg::Relay)
+    MESSAGE(Spectate, Msg::Spectate)
+    //Every cell of the master's field, sent to spectators when they join or fall behind.
+    MESSAGE(Keyframe, Msg::Keyframe)
+    //Cells died and born in the last generation.
+    MESSAGE(Delta, Msg::Delta)
 };
 
 #endif /* Peer_hpp */
@@ -42,6 +42,7 @@ Presets::Presets(const std::string &path) : path(path) {
 }
 
 void Presets::SaveOnDisk() {
+    std::lock_guard<std::mutex> lock(mutex);
     std::fstream file;
     file.open(path, std::fstream::out | std::fstream::trunc);
     for (const auto &iter : presets) {
@@ -59,20 +60,14 @@ void Presets::SaveOnDisk() {
 }
 
 void Presets::Save(unsigned char preset, const VectorsPtr units) {
-    auto result = presets.find(preset);
-    VectorsPtr vector;
-    if (result == presets.end()) {
-        auto inserted = presets.insert(std::make_pair(preset, std::make_shared<Vectors>()));
-        if (!inserted.second) return;
-        vector = inserted.first->second;
-    } else {
-        vector = result->second;
-        vector->clear();
-    }
-    vector->assign(units->cbegin(), units->cend());
+    //Loaded presets are shared with the simulation thread, so a saved preset always gets a fresh vector.
+    VectorsPtr vector = std::make_shared<Vectors>(units->cbegin(), units->cend());
+    std::lock_guard<std::mutex> lock(mutex);
+    presets[preset] = vector;
 }
 
 const std::shared_ptr<std::vector<Vector>> Presets::Load(unsigned char preset) const {
+    std::lock_guard<std::mutex> lock(mutex);
     auto result = presets.find(preset);
     if (result == presets.end()) return nullptr;
     return result->second;
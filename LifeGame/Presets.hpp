@@ -13,6 +13,7 @@
 #include <vector>
 #include <string>
 #include <memory>
+#include <mutex>
 #include "Geometry.h"
 
 class Presets {
@@ -20,6 +21,7 @@ class Presets {
     typedef std::shared_ptr<Vectors> VectorsPtr;
     
     std::unordered_map<unsigned char, VectorsPtr> presets;
+    mutable std::mutex mutex;
     const std::string path;
     
 public:
@@ -0,0 +1,60 @@
+//
+//  ProximityMap.cpp
+//  LifeGame
+//
+
+#include <algorithm>
+#include <cassert>
+#include "ProximityMap.hpp"
+
+using namespace Geometry;
+
+ProximityMap::ProximityMap(int distance) : rowWords(0), distance(distance) {}
+
+void ProximityMap::Reset(Vector size) {
+    if (this->size != size) {
+        this->size = size;
+        rowWords = (size.x + 63) / 64;
+        bits.resize(static_cast<size_t>(rowWords) * size.y);
+    }
+    std::fill(bits.begin(), bits.end(), 0);
+}
+
+void ProximityMap::Stamp(Vector unit) {
+    assert(unit.x >= 0 && unit.x < size.x && unit.y >= 0 && unit.y < size.y);
+    const int span = 2 * distance + 1;
+    int fromX = unit.x - distance;
+    if (fromX < 0) fromX += size.x;
+    const int rows = std::min(span, size.y);
+    int y = unit.y - distance;
+    if (y < 0) y += size.y;
+    
+    for (int i = 0; i < rows; i++, y = y + 1 == size.y ? 0 : y + 1) {
+        uint64_t *row = bits.data() + static_cast<size_t>(y) * rowWords;
+        if (span >= size.x) {
+            SetRange(row, 0, size.x);
+        } else if (fromX + span <= size.x) {
+            SetRange(row, fromX, fromX + span);
+        } else {
+            SetRange(row, fromX, size.x);
+            SetRange(row, 0, fromX + span - size.x);
+        }
+    }
+}
+
+void ProximityMap::SetRange(uint64_t *row, int from, int to) {
+    const int first = from >> 6;
+    const int last = (to - 1) >> 6;
+    const uint64_t all = ~uint64_t(0);
+    const uint64_t head = all << (from & 63);
+    const uint64_t tail = all >> (63 - ((to - 1) & 63));
+    if (first == last) {
+        row[first] |= head & tail;
+        return;
+    }
+    row[first] |= head;
+    for (int i = first + 1; i < last; i++) {
+        row[i] = all;
+    }
+    row[last] |= tail;
+}
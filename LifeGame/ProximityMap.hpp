@@ -0,0 +1,38 @@
+//
+//  ProximityMap.hpp
+//  LifeGame
+//
+
+#ifndef ProximityMap_hpp
+#define ProximityMap_hpp
+
+#include <vector>
+#include <cassert>
+#include <stdint.h>
+#include "Geometry.h"
+
+//Bitmap over the torus with a bit set for every cell within Chebyshev distance of any stamped unit.
+class ProximityMap {
+    std::vector<uint64_t> bits;
+    Geometry::Vector size;
+    int rowWords;
+    const int distance;
+    
+public:
+    explicit ProximityMap(int distance);
+    
+    Geometry::Vector GetSize() const { return size; }
+    
+    void Reset(Geometry::Vector size);
+    void Stamp(Geometry::Vector unit);
+    bool Test(Geometry::Vector cell) const {
+        assert(cell.x >= 0 && cell.x < size.x && cell.y >= 0 && cell.y < size.y);
+        const uint64_t word = bits[cell.y * rowWords + (cell.x >> 6)];
+        return (word >> (cell.x & 63)) & 1;
+    }
+    
+private:
+    void SetRange(uint64_t *row, int from, int to);
+};
+
+#endif /* ProximityMap_hpp */
@@ -0,0 +1,68 @@
+//
+//  RingBuffer.cpp
+//  LifeGame
+//
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include "RingBuffer.hpp"
+
+namespace Network {
+
+    static uint32_t NextPowerOfTwo(uint32_t value) {
+        uint32_t result = 1;
+        while (result < value) {
+            result <<= 1;
+        }
+        return result;
+    }
+    
+    RingBuffer::RingBuffer(uint32_t capacity) :
+        buffer(NextPowerOfTwo(capacity)),
+        mask(static_cast<uint32_t>(buffer.size()) - 1),
+        head(0),
+        tail(0) {}
+    
+    void RingBuffer::Reserve(uint32_t count) {
+        if (Writable() >= count) return;
+        const uint32_t readable = Readable();
+        std::vector<uint8_t> newBuffer(NextPowerOfTwo(readable + count));
+        Peek(newBuffer.data(), readable);
+        buffer.swap(newBuffer);
+        mask = static_cast<uint32_t>(buffer.size()) - 1;
+        head = 0;
+        tail = readable;
+    }
+    
+    int RingBuffer::WriteSegments(IOBuffer buffers[2]) {
+        const uint32_t writable = Writable();
+        if (writable == 0) return 0;
+        const uint32_t start = tail & mask;
+        const uint32_t first = std::min(writable, Capacity() - start);
+        buffers[0].data = buffer.data() + start;
+        buffers[0].size = first;
+        if (first == writable) return 1;
+        buffers[1].data = buffer.data();
+        buffers[1].size = writable - first;
+        return 2;
+    }
+    
+    void RingBuffer::Peek(void *data, uint32_t count, uint32_t offset) const {
+        if (offset + count > Readable()) {
+            throw std::out_of_range("Not enough data!");
+        }
+        const uint32_t start = (head + offset) & mask;
+        const uint32_t first = std::min(count, Capacity() - start);
+        std::memcpy(data, buffer.data() + start, first);
+        std::memcpy(static_cast<uint8_t *>(data) + first, buffer.data(), count - first);
+    }
+    
+    const uint8_t *RingBuffer::Contiguous(uint32_t count, uint32_t offset) const {
+        if (offset + count > Readable()) return nullptr;
+        const uint32_t start = (head + offset) & mask;
+        if (start + count > Capacity()) return nullptr;
+        return buffer.data() + start;
+    }
+
+}
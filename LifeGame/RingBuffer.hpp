@@ -0,0 +1,44 @@
+//
+//  RingBuffer.hpp
+//  LifeGame
+//
+
+#ifndef RingBuffer_hpp
+#define RingBuffer_hpp
+
+#include <vector>
+#include <stdint.h>
+#include "TCPSocket.hpp"
+
+namespace Network {
+
+    //Byte queue over a power of two buffer. Head and tail run freely and are masked on access,
+    //so consuming data never moves the bytes that are still pending.
+    class RingBuffer {
+        std::vector<uint8_t> buffer;
+        uint32_t mask;
+        uint32_t head;
+        uint32_t tail;
+    
+    public:
+        explicit RingBuffer(uint32_t capacity);
+        
+        uint32_t Capacity() const { return static_cast<uint32_t>(buffer.size()); }
+        uint32_t Readable() const { return tail - head; }
+        uint32_t Writable() const { return Capacity() - Readable(); }
+        
+        //Grows the buffer until at least count bytes can be written.
+        void Reserve(uint32_t count);
+        //Fills buffers with the free space and returns the number of segments used.
+        int WriteSegments(IOBuffer buffers[2]);
+        void Commit(uint32_t count) { tail += count; }
+        
+        void Peek(void *data, uint32_t count, uint32_t offset = 0) const;
+        //Returns the pending bytes at offset if they do not wrap around the end, otherwise nullptr.
+        const uint8_t *Contiguous(uint32_t count, uint32_t offset = 0) const;
+        void Consume(uint32_t count) { head += count; }
+    };
+
+}
+
+#endif /* RingBuffer_hpp */
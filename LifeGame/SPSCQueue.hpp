@@ -0,0 +1,54 @@
+//
+//  SPSCQueue.hpp
+//  LifeGame
+//
+
+#ifndef SPSCQueue_hpp
+#define SPSCQueue_hpp
+
+#include <atomic>
+#include <cstddef>
+
+//Bounded lock-free queue for exactly one producer thread and one consumer thread.
+template <typename T, size_t capacity>
+class SPSCQueue {
+    static_assert(capacity > 0 && (capacity & (capacity - 1)) == 0, "SPSCQueue capacity should be a power of two!");
+    
+    T items[capacity];
+    std::atomic<size_t> head;
+    std::atomic<size_t> tail;
+    
+public:
+    explicit SPSCQueue() : head(0), tail(0) {}
+    SPSCQueue(const SPSCQueue &other) = delete;
+    SPSCQueue &operator = (const SPSCQueue &other) = delete;
+    
+    constexpr static size_t Capacity() { return capacity; }
+    
+    bool Push(T item) {
+        const size_t back = tail.load(std::memory_order_relaxed);
+        if (back - head.load(std::memory_order_acquire) == capacity) return false;
+        items[back & (capacity - 1)] = std::move(item);
+        tail.store(back + 1, std::memory_order_release);
+        return true;
+    }
+    
+    bool Pop(T &item) {
+        const size_t front = head.load(std::memory_order_relaxed);
+        if (front == tail.load(std::memory_order_acquire)) return false;
+        item = std::move(items[front & (capacity - 1)]);
+        head.store(front + 1, std::memory_order_release);
+        return true;
+    }
+    
+    //Only meaningful on the producer thread: a push right after a false result always succeeds.
+    bool Full() const {
+        return tail.load(std::memory_order_relaxed) - head.load(std::memory_order_acquire) == capacity;
+    }
+    
+    bool Empty() const {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+};
+
+#endif /* SPSCQueue_hpp */
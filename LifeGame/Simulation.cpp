@@ -0,0 +1,135 @@
+//
+//  Simulation.cpp
+//  LifeGame
+//
+
+#include <chrono>
+#include "Utils.hpp"
+#include "GameField.hpp"
+#include "Simulation.hpp"
+
+using namespace Geometry;
+
+const int Simulation::pollTime = 10;
+const int Simulation::idlePollTime = 100;
+
+Simulation::Simulation(std::shared_ptr<GameField> gameField) :
+    gameField(gameField),
+    generation(0),
+    received(false),
+    running(false),
+    finished(false) {}
+
+Simulation::~Simulation() {
+    Stop();
+}
+
+void Simulation::Start(std::function<void()> onChange) {
+    if (running) return;
+    this->onChange = onChange;
+    Publish();
+    running = true;
+    gameField->StartNetwork([this]() { Receive(); });
+    thread = std::thread(&Simulation::Run, this);
+}
+
+void Simulation::Stop() {
+    running = false;
+    wake.notify_one();
+    if (thread.joinable()) {
+        thread.join();
+        gameField->StopNetwork();
+    }
+}
+
+void Simulation::Receive() {
+    std::lock_guard<std::mutex> lock(wakeMutex);
+    received = true;
+    wake.notify_one();
+}
+
+void Simulation::Post(const Input &input) {
+    if (!inputs.Push(input)) {
+        Log::Warning("Simulation input queue is full!");
+        return;
+    }
+    std::lock_guard<std::mutex> lock(wakeMutex);
+    wake.notify_one();
+}
+
+void Simulation::Acquire(SnapshotPtr &snapshot) {
+    std::lock_guard<std::mutex> lock(publishMutex);
+    snapshot = published;
+}
+
+void Simulation::Run() {
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point nextTurn = Clock::now() + std::chrono::milliseconds(gameField->TurnTime());
+    uint32_t generation = gameField->Generation();
+    
+    //While paused or waiting for players nothing is scheduled, so only the network needs an occasional poll.
+    while (running) {
+        Input input;
+        while (inputs.Pop(input)) {
+            Apply(input);
+        }
+        if (!gameField->Update()) break;
+        
+        const std::chrono::milliseconds turnTime(gameField->TurnTime());
+        Clock::time_point now = Clock::now();
+        if (turnTime.count() > 0 && now >= nextTurn) {
+            gameField->Turn();
+            nextTurn += turnTime;
+            if (nextTurn < now) nextTurn = now + turnTime;
+            nextTurn = gameField->ScheduleTurn(nextTurn);
+        }
+        if (generation != gameField->Generation()) {
+            generation = gameField->Generation();
+            Publish();
+        }
+        
+        const bool idle = gameField->IsIdle();
+        Clock::time_point wakeTime = Clock::now() + std::chrono::milliseconds(idle ? idlePollTime : pollTime);
+        if (!idle && nextTurn < wakeTime) wakeTime = nextTurn;
+        std::unique_lock<std::mutex> lock(wakeMutex);
+        wake.wait_until(lock, wakeTime, [this]() { return !running || !inputs.Empty() || received; });
+        received = false;
+    }
+    finished = true;
+    if (onChange != nullptr) onChange();
+}
+
+void Simulation::Apply(const Input &input) {
+    switch (input.type) {
+        case Input::Type::AddUnit:   gameField->AddUnit(input.cell);                      break;
+        case Input::Type::AddPreset: gameField->AddPreset(input.transform, input.preset); break;
+        case Input::Type::Turn:      gameField->Turn();                                   break;
+        case Input::Type::Pause:     gameField->Pause();                                  break;
+        case Input::Type::Destroy:   gameField->Destroy();                                break;
+    }
+}
+
+void Simulation::Publish() {
+    std::shared_ptr<FieldSnapshot> buffer, previous;
+    {
+        std::lock_guard<std::mutex> lock(publishMutex);
+        previous = published;
+        for (const auto &candidate : buffers) {
+            if (candidate.use_count() == 1) {
+                buffer = candidate;
+                break;
+            }
+        }
+    }
+    if (buffer == nullptr) {
+        buffer = std::make_shared<FieldSnapshot>();
+        buffers.push_back(buffer);
+    }
+    gameField->FillSnapshot(*buffer, previous.get());
+    {
+        std::lock_guard<std::mutex> lock(publishMutex);
+        published = buffer;
+        generation = buffer->generation;
+    }
+    if (onChange != nullptr) onChange();
+}
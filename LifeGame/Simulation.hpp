@@ -0,0 +1,101 @@
+//
+//  Simulation.hpp
+//  LifeGame
+//
+
+#ifndef Simulation_hpp
+#define Simulation_hpp
+
+#include <memory>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+#include "Geometry.h"
+#include "TileIndex.hpp"
+#include "SPSCQueue.hpp"
+
+//Immutable view of the field published once per generation for the render thread.
+//It carries everything the renderer reads, as the field's size and turn time change on the simulation thread.
+struct FieldSnapshot {
+    TileIndex tiles;
+    Geometry::Vector size;
+    unsigned turnTime;
+    uint32_t generation;
+    
+    FieldSnapshot() : turnTime(0), generation(0) {}
+    
+    void ClampVector(Geometry::Vector &vec) const {
+        vec.x %= size.x;
+        vec.y %= size.y;
+        if (vec.x < 0) vec.x = size.x + vec.x;
+        if (vec.y < 0) vec.y = size.y + vec.y;
+    }
+};
+
+//Runs GameField turns on a dedicated thread, while the peer's sockets are served by an I/O thread of their own.
+//The render thread only reads published snapshots and posts Input through a lock-free queue.
+class Simulation {
+public:
+    struct Input {
+        enum class Type {
+            AddUnit,
+            AddPreset,
+            Turn,
+            Pause,
+            Destroy
+        };
+        
+        Type type;
+        Geometry::Vector cell;
+        Geometry::Transform transform;
+        unsigned char preset;
+        
+        Input() : type(Type::Turn), preset(0) {}
+        explicit Input(Type type) : type(type), preset(0) {}
+    };
+    
+    typedef std::shared_ptr<const FieldSnapshot> SnapshotPtr;
+    
+private:
+    static const int pollTime;
+    static const int idlePollTime;
+    
+    std::shared_ptr<class GameField> gameField;
+    SPSCQueue<Input, 256> inputs;
+    std::vector<std::shared_ptr<FieldSnapshot>> buffers;
+    std::shared_ptr<FieldSnapshot> published;
+    std::mutex publishMutex;
+    std::mutex wakeMutex;
+    std::condition_variable wake;
+    std::atomic<uint32_t> generation;
+    std::atomic<bool> received;
+    std::atomic<bool> running;
+    std::atomic<bool> finished;
+    std::thread thread;
+    std::function<void()> onChange;
+    
+public:
+    explicit Simulation(std::shared_ptr<class GameField> gameField);
+    ~Simulation();
+    Simulation(const Simulation &other) = delete;
+    Simulation &operator = (const Simulation &other) = delete;
+    
+    //onChange is called on the simulation thread after a generation is published and when the game ends.
+    void Start(std::function<void()> onChange = nullptr);
+    void Stop();
+    bool Finished() const { return finished; }
+    uint32_t Generation() const { return generation; }
+    void Post(const Input &input);
+    void Acquire(SnapshotPtr &snapshot);
+    
+private:
+    void Run();
+    void Receive();
+    void Apply(const Input &input);
+    void Publish();
+};
+
+#endif /* Simulation_hpp */
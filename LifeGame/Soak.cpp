@@ -0,0 +1,216 @@
+//
+//  Soak.cpp
+//  LifeGame
+//
+
+#include <algorithm>
+#include <ctime>
+#include <thread>
+#include "Soak.hpp"
+#include "Allocations.hpp"
+#include "GameField.hpp"
+#include "Utils.hpp"
+
+using namespace Geometry;
+
+const int Soak::stuckTime = 10000;
+const int Soak::maxLoopbackDelay = 2;
+
+Soak::Soak(std::shared_ptr<Presets> presets, const Options &options) :
+    options(options),
+    presets(presets),
+    random(options.seed) {
+    //Simulation threads keep pointers into players, so it never reallocates.
+    players.reserve(options.players);
+}
+
+bool Soak::Run() {
+    Start();
+    const Clock::time_point start = Clock::now();
+    const std::clock_t cpuStart = std::clock();
+    const bool played = Play();
+    const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    const double cpuSeconds = static_cast<double>(std::clock() - cpuStart) / CLOCKS_PER_SEC;
+    Stop();
+    if (!played) return false;
+    Log::Warning("Soak:", options.players, "players played", options.turns, "turns in", seconds, "s,",
+                 options.turns / seconds, "turns/s,", players.front().gameField->GetUnits()->size(), "units left");
+    const unsigned cores = std::max(std::thread::hardware_concurrency(), 1u);
+    return Check(100.0 * cpuSeconds / (seconds * cores));
+}
+
+void Soak::Start() {
+    std::shared_ptr<GameField> masterField = std::make_shared<GameField>(presets, options.field, options.turnTime, 0);
+    std::shared_ptr<Peer> master = std::make_shared<Peer>(masterField, options.players, options.topology);
+    AddPlayer(masterField, master);
+    //The master listens on every interface; the players reach it over loopback.
+    const std::string listenerAddress = master->PublicAddress();
+    const std::string address = "127.0.0.1" + listenerAddress.substr(listenerAddress.find_last_of(':'));
+    for (int i = 1; i < options.players; i++) {
+        std::shared_ptr<GameField> gameField = std::make_shared<GameField>(presets);
+        AddPlayer(gameField, std::make_shared<Peer>(gameField, address));
+    }
+}
+
+void Soak::AddPlayer(std::shared_ptr<GameField> gameField, std::shared_ptr<Peer> peer) {
+    players.emplace_back();
+    Player &player = players.back();
+    player.gameField = gameField;
+    player.peer = peer;
+    player.records.resize(options.turns + 1);
+    
+    std::vector<Record> *records = &player.records;
+    const Peer *self = peer.get();
+    peer->SetTurnCallback([records, self](uint32_t turn, uint64_t checksum, Clock::duration time) {
+        if (turn >= records->size()) return;
+        Record &record = (*records)[turn];
+        record.checksum = checksum;
+        record.time = time;
+        record.allocations = self->CommandAllocations();
+        record.inputDelay = self->InputDelay();
+        record.done = true;
+    });
+    peer->SetPrediction(options.predict);
+    if (options.impairment != nullptr) {
+        peer->SetImpairment(*options.impairment);
+    }
+    peer->SetReport(options.report);
+    //Players join one by one while the peers before them are already running, just like separate processes.
+    peer->Init();
+    player.simulation = std::make_shared<Simulation>(gameField);
+    player.simulation->Start();
+}
+
+bool Soak::Play() {
+    Clock::time_point progressTime = Clock::now();
+    uint32_t progress = 0;
+    while (true) {
+        uint32_t slowest = options.turns;
+        for (size_t i = 0; i < players.size(); i++) {
+            Simulation &simulation = *players[i].simulation;
+            if (simulation.Finished()) {
+                Log::Warning("Soak: player", i, "stopped at generation", simulation.Generation());
+                return false;
+            }
+            slowest = std::min(slowest, simulation.Generation());
+            AddInput(players[i]);
+        }
+        if (slowest >= options.turns) return true;
+        
+        const Clock::time_point now = Clock::now();
+        if (slowest > progress) {
+            progress = slowest;
+            progressTime = now;
+        } else if (now - progressTime > std::chrono::milliseconds(stuckTime)) {
+            Log::Warning("Soak: no turn for", stuckTime, "ms at generation", progress);
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(std::max(options.turnTime, 1u)));
+    }
+}
+
+void Soak::AddInput(Player &player) {
+    Simulation &simulation = *player.simulation;
+    const uint32_t generation = simulation.Generation();
+    if (generation == player.inputGeneration) return;
+    player.inputGeneration = generation;
+    //A small cluster has a chance to live for a while, unlike scattered cells. It stays off the edges, as cells are not wrapped.
+    const Vector center(1 + Next(options.field.x - 2), 1 + Next(options.field.y - 2));
+    for (int i = 0; i < options.unitsPerTurn; i++) {
+        Simulation::Input input(Simulation::Input::Type::AddUnit);
+        input.cell = center + Vector(Next(3) - 1, Next(3) - 1);
+        simulation.Post(input);
+    }
+    if (Next(20) == 0) {
+        Simulation::Input input(Simulation::Input::Type::AddPreset);
+        input.preset = static_cast<unsigned char>('1' + Next(9));
+        input.transform = Transform(static_cast<uint8_t>(Next(Transform::Orientations())), Vector(Next(options.field.x), Next(options.field.y)));
+        simulation.Post(input);
+    }
+}
+
+int Soak::Next(int max) {
+    return static_cast<int>(random() % static_cast<uint32_t>(std::max(max, 1)));
+}
+
+void Soak::Stop() {
+    for (const auto &player : players) {
+        player.simulation->Post(Simulation::Input(Simulation::Input::Type::Destroy));
+    }
+    const Clock::time_point deadline = Clock::now() + std::chrono::milliseconds(stuckTime);
+    for (const auto &player : players) {
+        while (!player.simulation->Finished() && Clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        player.simulation->Stop();
+    }
+}
+
+bool Soak::Check(double cpuLoad) const {
+    std::vector<Clock::duration> times;
+    times.reserve(options.turns * players.size());
+    for (uint32_t turn = 1; turn <= options.turns; turn++) {
+        const Record &expected = players.front().records[turn];
+        for (size_t i = 0; i < players.size(); i++) {
+            const Record &record = players[i].records[turn];
+            if (!record.done) {
+                Log::Warning("Soak: player", i, "did not play turn", turn);
+                return false;
+            }
+            if (record.checksum != expected.checksum) {
+                Log::Warning("Soak: player", i, "diverged from player 0 at turn", turn);
+                return false;
+            }
+            times.push_back(record.time);
+        }
+    }
+    if (Allocations::Counted()) {
+        //The first half warms up the pools, and a change of the input delay resizes the queues,
+        //so every turn after both has to handle its commands without a single allocation.
+        for (size_t i = 0; i < players.size(); i++) {
+            const std::vector<Record> &records = players[i].records;
+            uint32_t from = options.turns / 2;
+            for (uint32_t turn = from + 1; turn <= options.turns; turn++) {
+                if (records[turn].inputDelay != records[turn - 1].inputDelay) from = turn;
+            }
+            if (from == options.turns) {
+                Log::Warning("Soak: allocation check skipped for player", i, "as its input delay changed at the last turn");
+            }
+            for (uint32_t turn = from + 1; turn <= options.turns; turn++) {
+                if (records[turn].allocations != records[turn - 1].allocations) {
+                    Log::Warning("Soak: player", i, "made", records[turn].allocations - records[turn - 1].allocations,
+                                 "allocations handling commands at turn", turn, "after its last input delay change at turn", from);
+                    return false;
+                }
+            }
+        }
+    } else {
+        Log::Warning("Soak: allocation check skipped, build with LIFEGAME_COUNT_ALLOCATIONS to count allocations");
+    }
+    //A player alone has no round trips to measure and keeps the initial delay.
+    if (options.impairment == nullptr && players.size() > 1) {
+        if (cpuLoad > options.maxCpuLoad) {
+            Log::Warning("Soak: input delay check skipped, the match kept", cpuLoad, "% of the cores busy, over the limit of", options.maxCpuLoad, "%");
+        } else {
+            for (size_t i = 0; i < players.size(); i++) {
+                const int delay = players[i].peer->InputDelay();
+                if (delay > maxLoopbackDelay) {
+                    Log::Warning("Soak: player", i, "input delay is", delay, "turns over loopback, expected at most", maxLoopbackDelay);
+                    return false;
+                }
+            }
+        }
+    }
+    if (times.empty()) return true;
+    typedef std::chrono::duration<double, std::micro> Microseconds;
+    std::sort(times.begin(), times.end());
+    Clock::duration total = Clock::duration::zero();
+    for (const auto &time : times) {
+        total += time;
+    }
+    Log::Warning("Soak: checksums agree; turn takes", Microseconds(total).count() / times.size(), "us on average,",
+                 Microseconds(times[times.size() / 2]).count(), "us median,",
+                 Microseconds(times[times.size() * 99 / 100]).count(), "us at 99th percentile,",
+                 Microseconds(times.back()).count(), "us at most");
+    return true;
+}
@@ -0,0 +1,109 @@
+//
+//  Soak.hpp
+//  LifeGame
+//
+
+#ifndef Soak_hpp
+#define Soak_hpp
+
+#include <vector>
+#include <memory>
+#include <random>
+#include <chrono>
+#include "Geometry.h"
+#include "Peer.hpp"
+#include "Simulation.hpp"
+
+//Runs a whole match of headless peers in one process over loopback, feeds them random input
+//and checks afterwards that every peer went through the same fields turn by turn.
+class Soak {
+    typedef std::chrono::steady_clock Clock;
+
+public:
+    struct Options {
+        int players;
+        uint32_t turns;
+        unsigned turnTime;
+        Geometry::Vector field;
+        Peer::Topology topology;
+        bool predict;
+        bool report;
+        //Every peer is reached through a proxy with this profile, nullptr for direct links.
+        const Network::ImpairmentProfile *impairment;
+        //Seeds the input, so a run issues the same input again, though timing still decides the turns it lands on.
+        uint32_t seed;
+        //Cells each player tries to add per turn.
+        int unitsPerTurn;
+        //The loopback input delay is only checked if the match kept at most this percentage of the cores busy,
+        //as peers that compete for the cores wait for each other's turns rather than for the network. 100 always checks it.
+        int maxCpuLoad;
+        
+        Options() :
+            players(2),
+            turns(1000),
+            turnTime(10),
+            field(200, 200),
+            topology(Peer::Topology::Mesh),
+            predict(false),
+            report(false),
+            impairment(nullptr),
+            seed(0),
+            unitsPerTurn(5),
+            maxCpuLoad(50) {}
+    };
+
+private:
+    //No progress for that long means the match is stuck.
+    static const int stuckTime;
+    //Round trips over loopback are far below a turn, so the input delay has to come down to this.
+    static const int maxLoopbackDelay;
+    
+    struct Record {
+        uint64_t checksum;
+        Clock::duration time;
+        //Peer's allocation count and input delay after the turn.
+        uint64_t allocations;
+        int inputDelay;
+        bool done;
+        
+        Record() : checksum(0), time(Clock::duration::zero()), allocations(0), inputDelay(0), done(false) {}
+    };
+    
+    struct Player {
+        std::shared_ptr<GameField> gameField;
+        std::shared_ptr<Peer> peer;
+        std::shared_ptr<Simulation> simulation;
+        //Written by the player's simulation thread and read once it is stopped.
+        std::vector<Record> records;
+        //Generation the last input was issued at; a player gets new input once per turn it plays.
+        uint32_t inputGeneration;
+        
+        Player() : inputGeneration(0) {}
+    };
+    
+    Options options;
+    std::shared_ptr<class Presets> presets;
+    std::vector<Player> players;
+    std::mt19937 random;
+
+public:
+    explicit Soak(std::shared_ptr<class Presets> presets, const Options &options);
+    Soak(const Soak &other) = delete;
+    Soak &operator = (const Soak &other) = delete;
+    
+    //Returns true if every peer played all turns and their checksums agree on each of them.
+    bool Run();
+
+private:
+    void Start();
+    bool Play();
+    void Stop();
+    //cpuLoad is the percentage of the cores the match kept busy.
+    bool Check(double cpuLoad) const;
+    void AddInput(Player &player);
+    //Returns a number from 0 to max - 1.
+    int Next(int max);
+    void AddPlayer(std::shared_ptr<GameField> gameField, std::shared_ptr<Peer> peer);
+};
+
+#endif /* Soak_hpp */
@@ -0,0 +1,152 @@
+//
+//  SocketPoller.cpp
+//  LifeGame
+//
+
+#if defined(__linux__)
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+#include <algorithm>
+#include "SocketPoller.hpp"
+#include "SocketSelector.hpp"
+#include "Utils.hpp"
+
+namespace Network {
+
+#if defined(__linux__)
+
+    SocketPoller::SocketPoller() : epoll(epoll_create1(EPOLL_CLOEXEC)), events(64) {
+        if (epoll < 0) {
+            Log::Error("SocketPoller::SocketPoller failed!");
+        }
+    }
+    
+    SocketPoller::~SocketPoller() {
+        close(epoll);
+    }
+    
+    void SocketPoller::Add(TCPSocketPtr socket, bool edgeTriggered) {
+        Registration registration = { socket, edgeTriggered, false };
+        Control(EPOLL_CTL_ADD, registration);
+        sockets[socket->sock] = registration;
+    }
+    
+    void SocketPoller::Remove(TCPSocketPtr socket) {
+        if (socket == nullptr) return;
+        auto iter = sockets.find(socket->sock);
+        if (iter == sockets.end() || iter->second.socket != socket) return;
+        epoll_ctl(epoll, EPOLL_CTL_DEL, socket->sock, nullptr);
+        sockets.erase(iter);
+    }
+    
+    void SocketPoller::SetWrite(TCPSocketPtr socket, bool enable) {
+        auto iter = sockets.find(socket->sock);
+        if (iter == sockets.end() || iter->second.write == enable) return;
+        iter->second.write = enable;
+        //Re-arming also re-evaluates readiness, so an already writable socket is reported on the next wait.
+        Control(EPOLL_CTL_MOD, iter->second);
+    }
+    
+    bool SocketPoller::Empty() const {
+        return sockets.empty();
+    }
+    
+    int SocketPoller::Wait(std::vector<TCPSocketPtr> &outRead, std::vector<TCPSocketPtr> &outWrite, bool block) {
+        outRead.clear();
+        outWrite.clear();
+        int result = epoll_wait(epoll, events.data(), static_cast<int>(events.size()), block ? -1 : 0);
+        if (result < 0) {
+            if (errno == EINTR) return 0;
+            Log::Error("SocketPoller::Wait failed!");
+        }
+        for (int i = 0; i < result; i++) {
+            auto iter = sockets.find(events[i].data.fd);
+            if (iter == sockets.end()) continue;
+            const uint32_t flags = events[i].events;
+            //A hang-up may arrive together with the last data; level-triggering it keeps it reported until the socket is removed.
+            if ((flags & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && iter->second.edgeTriggered) {
+                iter->second.edgeTriggered = false;
+                Control(EPOLL_CTL_MOD, iter->second);
+            }
+            //Errors and hang-ups are delivered as reads so the connection sees the failing recv and closes.
+            if (flags & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
+                outRead.push_back(iter->second.socket);
+            }
+            if (flags & EPOLLOUT) {
+                outWrite.push_back(iter->second.socket);
+            }
+        }
+        if (static_cast<size_t>(result) == events.size()) {
+            events.resize(events.size() * 2);
+        }
+        return result;
+    }
+    
+    void SocketPoller::Control(int operation, const Registration &registration) {
+        epoll_event event = {};
+        const uint32_t write = registration.write ? static_cast<uint32_t>(EPOLLOUT) : 0;
+        const uint32_t edge = registration.edgeTriggered ? static_cast<uint32_t>(EPOLLET) : 0;
+        event.events = static_cast<uint32_t>(EPOLLIN | EPOLLRDHUP) | write | edge;
+        event.data.fd = registration.socket->sock;
+        if (epoll_ctl(epoll, operation, registration.socket->sock, &event) < 0) {
+            Log::Error("SocketPoller::Control failed!");
+        }
+    }
+    
+#else
+
+    SocketPoller::SocketPoller() {}
+    
+    SocketPoller::~SocketPoller() {}
+    
+    //select has no edge-triggered mode; every socket is level-triggered.
+    void SocketPoller::Add(TCPSocketPtr socket, bool) {
+        readList.Insert(socket);
+    }
+    
+    void SocketPoller::Remove(TCPSocketPtr socket) {
+        readList.Erase(socket);
+        writeList.Erase(socket);
+    }
+    
+    void SocketPoller::SetWrite(TCPSocketPtr socket, bool enable) {
+        if (enable) {
+            writeList.Insert(socket);
+        } else {
+            writeList.Erase(socket);
+        }
+    }
+    
+    bool SocketPoller::Empty() const {
+        return readList.sockets.empty() && writeList.sockets.empty();
+    }
+    
+    int SocketPoller::Wait(std::vector<TCPSocketPtr> &outRead, std::vector<TCPSocketPtr> &outWrite, bool block) {
+        outRead.clear();
+        outWrite.clear();
+        return SocketSelector::Select(&readList.sockets, &outRead, &writeList.sockets, &outWrite, nullptr, nullptr, block);
+    }
+    
+    void SocketPoller::SocketList::Insert(const TCPSocketPtr &socket) {
+        if (indices.count(socket.get()) != 0) return;
+        indices[socket.get()] = sockets.size();
+        sockets.push_back(socket);
+    }
+    
+    void SocketPoller::SocketList::Erase(const TCPSocketPtr &socket) {
+        auto iter = indices.find(socket.get());
+        if (iter == indices.end()) return;
+        const size_t index = iter->second;
+        indices.erase(iter);
+        if (index + 1 != sockets.size()) {
+            sockets[index] = sockets.back();
+            indices[sockets[index].get()] = index;
+        }
+        sockets.pop_back();
+    }
+    
+#endif
+
+}
@@ -0,0 +1,66 @@
+//
+//  SocketPoller.hpp
+//  LifeGame
+//
+
+#ifndef SocketPoller_hpp
+#define SocketPoller_hpp
+
+#include <vector>
+#include <unordered_map>
+#include "TCPSocket.hpp"
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#endif
+
+namespace Network {
+
+    //Keeps sockets registered between waits. Uses edge-triggered epoll on Linux and falls back to select elsewhere.
+    class SocketPoller {
+#if defined(__linux__)
+        struct Registration {
+            TCPSocketPtr socket;
+            bool edgeTriggered;
+            bool write;
+        };
+        
+        int epoll;
+        std::vector<epoll_event> events;
+        std::unordered_map<SOCKET, Registration> sockets;
+#else
+        //Swap-and-pop list, so registering and removing a socket does not scan the set.
+        struct SocketList {
+            std::vector<TCPSocketPtr> sockets;
+            std::unordered_map<const TCPSocket *, size_t> indices;
+            
+            void Insert(const TCPSocketPtr &socket);
+            void Erase(const TCPSocketPtr &socket);
+        };
+        
+        SocketList readList;
+        SocketList writeList;
+#endif
+
+    public:
+        explicit SocketPoller();
+        ~SocketPoller();
+        SocketPoller(const SocketPoller &) = delete;
+        SocketPoller &operator=(const SocketPoller &) = delete;
+        
+        //An edge-triggered socket is reported once per readiness change, so its reader has to drain it.
+        void Add(TCPSocketPtr socket, bool edgeTriggered = true);
+        void Remove(TCPSocketPtr socket);
+        void SetWrite(TCPSocketPtr socket, bool enable);
+        bool Empty() const;
+        int Wait(std::vector<TCPSocketPtr> &outRead, std::vector<TCPSocketPtr> &outWrite, bool block = true);
+        
+#if defined(__linux__)
+    private:
+        void Control(int operation, const Registration &registration);
+#endif
+    };
+    
+}
+
+#endif /* SocketPoller_hpp */
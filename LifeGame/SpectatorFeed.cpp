@@ -0,0 +1,109 @@
+//
+//  SpectatorFeed.cpp
+//  LifeGame
+//
+
+#include <algorithm>
+#include <stdexcept>
+#include "GameField.hpp"
+#include "SpectatorFeed.hpp"
+
+using namespace Geometry;
+using namespace Network;
+
+namespace Messaging {
+
+    bool SpectatorFeed::Update(const std::unordered_set<Unit> &units, uint32_t generation) {
+        const bool consecutive = valid && generation == this->generation + 1;
+        births.clear();
+        deaths.clear();
+        if (consecutive) {
+            for (const auto &unit : units) {
+                //Units compare by position, so a cell taken over by another player is a birth as well.
+                auto iter = previous.find(unit);
+                if (iter == previous.end() || iter->player != unit.player) {
+                    births.push_back(unit);
+                }
+            }
+            for (const auto &unit : previous) {
+                if (units.find(unit) == units.end()) {
+                    deaths.push_back(unit);
+                }
+            }
+            //Most cells live on, so applying the delta touches far fewer of them than copying the generation.
+            for (const auto &unit : deaths) {
+                previous.erase(unit);
+            }
+            for (const auto &unit : births) {
+                previous.erase(unit);
+                previous.insert(unit);
+            }
+        } else {
+            previous = units;
+        }
+        this->generation = generation;
+        valid = true;
+        return consecutive;
+    }
+    
+    void SpectatorFeed::WriteKeyframe(OutputMemoryStream &stream, const std::unordered_set<Unit> &units, Vector size) {
+        cells.assign(units.begin(), units.end());
+        WriteUnits(stream, cells, size);
+    }
+    
+    void SpectatorFeed::WriteDelta(OutputMemoryStream &stream, Vector size) {
+        WriteUnits(stream, deaths, size);
+        WriteUnits(stream, births, size);
+    }
+    
+    void SpectatorFeed::WriteUnits(OutputMemoryStream &stream, std::vector<Unit> &units, Vector size) {
+        const auto index = [size](const Unit &unit) {
+            return static_cast<uint64_t>(unit.position.y) * static_cast<uint64_t>(size.x) + static_cast<uint64_t>(unit.position.x);
+        };
+        std::sort(units.begin(), units.end(), [&index](const Unit &lhs, const Unit &rhs) {
+            return lhs.player != rhs.player ? lhs.player < rhs.player : index(lhs) < index(rhs);
+        });
+        stream.WriteVarint(static_cast<uint64_t>(units.size()));
+        size_t begin = 0;
+        while (begin < units.size()) {
+            size_t end = begin;
+            while (end < units.size() && units[end].player == units[begin].player) {
+                end++;
+            }
+            stream.WriteVarint(static_cast<uint64_t>(units[begin].player));
+            stream.WriteVarint(static_cast<uint64_t>(end - begin));
+            uint64_t last = 0;
+            for (size_t i = begin; i < end; i++) {
+                stream.WriteVarint(index(units[i]) - last);
+                last = index(units[i]);
+            }
+            begin = end;
+        }
+    }
+    
+    void SpectatorFeed::ReadUnits(InputMemoryStream &stream, std::vector<Unit> &units, Vector size) {
+        units.clear();
+        const uint64_t area = static_cast<uint64_t>(size.x) * static_cast<uint64_t>(size.y);
+        const uint64_t count = stream.ReadVarint();
+        if (count > area) {
+            throw std::out_of_range("Too many spectated cells!");
+        }
+        while (units.size() < count) {
+            const uint64_t player = stream.ReadVarint();
+            const uint64_t run = stream.ReadVarint();
+            if (player >= GameField::maxPlayers || run == 0 || run > count - units.size()) {
+                throw std::out_of_range("Wrong spectated cells!");
+            }
+            uint64_t index = 0;
+            for (uint64_t i = 0; i < run; i++) {
+                index += stream.ReadVarint();
+                if (index >= area) {
+                    throw std::out_of_range("Spectated cell is out of the field!");
+                }
+                const Vector position(static_cast<int>(index % size.x), static_cast<int>(index / size.x));
+                units.emplace_back(static_cast<int>(player), position);
+            }
+        }
+    }
+    
+}
@@ -0,0 +1,44 @@
+//
+//  SpectatorFeed.hpp
+//  LifeGame
+//
+
+#ifndef SpectatorFeed_hpp
+#define SpectatorFeed_hpp
+
+#include <vector>
+#include <unordered_set>
+#include <stdint.h>
+#include "Geometry.h"
+#include "Network.h"
+#include "Unit.hpp"
+
+namespace Messaging {
+
+    //Follows the field for spectators. Each generation is described by the cells born and died since the previous one,
+    //unless a keyframe of every cell encodes smaller or the previous generation was not seen.
+    class SpectatorFeed {
+        std::unordered_set<Unit> previous;
+        std::vector<Unit> births;
+        std::vector<Unit> deaths;
+        std::vector<Unit> cells;
+        uint32_t generation;
+        bool valid;
+        
+    public:
+        explicit SpectatorFeed() : generation(0), valid(false) {}
+        
+        //Diffs units against the previous generation; returns true if there is a delta to write.
+        bool Update(const std::unordered_set<Unit> &units, uint32_t generation);
+        void Reset() { valid = false; }
+        
+        void WriteKeyframe(Network::OutputMemoryStream &stream, const std::unordered_set<Unit> &units, Geometry::Vector size);
+        void WriteDelta(Network::OutputMemoryStream &stream, Geometry::Vector size);
+        //Cells are grouped by player and sorted, so positions are written as varint deltas.
+        static void WriteUnits(Network::OutputMemoryStream &stream, std::vector<Unit> &units, Geometry::Vector size);
+        static void ReadUnits(Network::InputMemoryStream &stream, std::vector<Unit> &units, Geometry::Vector size);
+    };
+    
+}
+
+#endif /* SpectatorFeed_hpp */
@@ -8,12 +8,14 @@
 
 #if !defined(_WIN32)
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
 #include <netinet/tcp.h>
 #include <netdb.h>
 #include <unistd.h>
 #endif
 
+#include <stdexcept>
 #include "Utils.hpp"
 #include "TCPSocket.hpp"
 
@@ -43,7 +45,8 @@ namespace Network {
     }
     
     void TCPSocket::NagleAlgorithm(bool enable) {
-        int flag = enable ? 1 : 0;
+        //TCP_NODELAY turns the algorithm off.
+        int flag = enable ? 0 : 1;
 #if defined(_WIN32)
 		int result = setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(flag));
 #else 
@@ -91,10 +94,13 @@ namespace Network {
     void TCPSocket::Shutdown() {
 #if defined(_WIN32)
         int result = shutdown(sock, SD_SEND);
+        const bool reset = result < 0 && WSAGetLastError() == WSAENOTCONN;
 #else
         int result = shutdown(sock, SHUT_WR);
+        const bool reset = result < 0 && errno == ENOTCONN;
 #endif
-        if (result < 0) {
+        //A peer that reset the connection first has nothing left to shut down.
+        if (result < 0 && !reset) {
             Log::Error("TCPSocket::Shutdown failed!");
         }
     }
@@ -111,6 +117,57 @@ namespace Network {
         return result;
     }
     
+    int TCPSocket::Send(const IOBuffer *buffers, int count) {
+        const int maxCount = 16;
+        if (count > maxCount) {
+            throw std::invalid_argument("TCPSocket::Send too many buffers!");
+        }
+#if defined(_WIN32)
+        WSABUF vectors[maxCount];
+        for (int i = 0; i < count; i++) {
+            vectors[i].buf = static_cast<char *>(buffers[i].data);
+            vectors[i].len = static_cast<ULONG>(buffers[i].size);
+        }
+        DWORD sent = 0;
+        u_long nonBlocking = 1;
+        ioctlsocket(sock, FIONBIO, &nonBlocking);
+        int result = WSASend(sock, vectors, count, &sent, 0, nullptr, nullptr) == 0 ? static_cast<int>(sent) : -1;
+        const int error = result < 0 ? WSAGetLastError() : 0;
+        nonBlocking = 0;
+        ioctlsocket(sock, FIONBIO, &nonBlocking);
+        if (result < 0) {
+            if (error == WSAEWOULDBLOCK) {
+                result = 0;
+            } else if (error == WSAECONNRESET) {
+#else
+        iovec vectors[maxCount];
+        for (int i = 0; i < count; i++) {
+            vectors[i].iov_base = buffers[i].data;
+            vectors[i].iov_len = buffers[i].size;
+        }
+        msghdr message = {};
+        message.msg_iov = vectors;
+        message.msg_iovlen = count;
+#if defined(MSG_NOSIGNAL)
+        const int flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+#else
+        const int flags = MSG_DONTWAIT;
+#endif
+        int result = static_cast<int>(sendmsg(sock, &message, flags));
+        if (result < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                result = 0;
+            } else if (errno == ECONNRESET || errno == EPIPE) {
+#endif
+                //The peer has closed the connection, which is how every peer leaves a match; the pending read reports the close.
+                result = 0;
+            } else {
+                Log::Error("TCPSocket::Send failed!");
+            }
+        }
+        return result;
+    }
+    
     int TCPSocket::Recv(void *buffer, size_t len, bool peek) {
 #if defined(_WIN32)
 		int result = recv(sock, (char *)buffer, len, peek ? MSG_PEEK : 0);
@@ -130,6 +187,53 @@ namespace Network {
         return result;
     }
     
+    int TCPSocket::Recv(IOBuffer *buffers, int count) {
+        const int maxCount = 2;
+        if (count > maxCount) {
+            throw std::invalid_argument("TCPSocket::Recv too many buffers!");
+        }
+#if defined(_WIN32)
+        WSABUF vectors[maxCount];
+        for (int i = 0; i < count; i++) {
+            vectors[i].buf = static_cast<char *>(buffers[i].data);
+            vectors[i].len = static_cast<ULONG>(buffers[i].size);
+        }
+        DWORD received = 0;
+        DWORD flags = 0;
+        u_long nonBlocking = 1;
+        ioctlsocket(sock, FIONBIO, &nonBlocking);
+        int result = WSARecv(sock, vectors, count, &received, &flags, nullptr, nullptr) == 0 ? static_cast<int>(received) : -1;
+        const int error = result < 0 ? WSAGetLastError() : 0;
+        nonBlocking = 0;
+        ioctlsocket(sock, FIONBIO, &nonBlocking);
+        if (result < 0) {
+            if (error == WSAEWOULDBLOCK) {
+                result = -1;
+            } else if (error == WSAECONNRESET) {
+#else
+        iovec vectors[maxCount];
+        for (int i = 0; i < count; i++) {
+            vectors[i].iov_base = buffers[i].data;
+            vectors[i].iov_len = buffers[i].size;
+        }
+        msghdr message = {};
+        message.msg_iov = vectors;
+        message.msg_iovlen = count;
+        int result = static_cast<int>(recvmsg(sock, &message, MSG_DONTWAIT));
+        if (result < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                result = -1;
+            } else if (errno == ECONNRESET) {
+#endif
+                Log::Warning("TCPSocket::Recv connection reset!");
+                result = 0;
+            } else {
+                Log::Error("TCPSocket::Recv failed!");
+            }
+        }
+        return result;
+    }
+    
     int TCPSocket::DataSize() const {
 #if defined(_WIN32)
 		unsigned long size;
@@ -17,8 +17,15 @@ typedef int SOCKET;
 
 namespace Network {
     
+    //One segment of a scatter/gather transfer.
+    struct IOBuffer {
+        void *data;
+        size_t size;
+    };
+    
     class TCPSocket {
         friend class SocketSelector;
+        friend class SocketPoller;
 		SOCKET sock;
 
     public:
@@ -32,7 +39,11 @@ namespace Network {
         void Listen(int backLog = SOMAXCONN);
         void Shutdown();
         int Send(void *buffer, size_t len);
+        //Never waits for the peer: returns what fit into the socket buffer, possibly 0, and 0 once the peer has closed the connection.
+        int Send(const IOBuffer *buffers, int count);
         int Recv(void *buffer, size_t len, bool peek = false);
+        //Never waits either: returns -1 if nothing has arrived, and 0 once the peer has closed the connection.
+        int Recv(IOBuffer *buffers, int count);
         int DataSize() const;
         std::shared_ptr<TCPSocket> Accept(SocketAddress address);
         
@@ -0,0 +1,57 @@
+//
+//  TileIndex.cpp
+//  LifeGame
+//
+
+#include <atomic>
+#include "TileIndex.hpp"
+
+using namespace Geometry;
+
+//Shared by all indices, as snapshots are pooled and a cache may see any of them next.
+static std::atomic<uint32_t> lastStamp(0);
+
+TileIndex::TileIndex() {}
+
+void TileIndex::Reset(Vector size) {
+    if (this->size != size) {
+        this->size = size;
+        tilesCount = Vector((size.x + tileSize - 1) >> tileShift, (size.y + tileSize - 1) >> tileShift);
+        tiles.clear();
+        tiles.resize(tilesCount.x * tilesCount.y);
+        stamps.assign(tiles.size(), 0);
+    }
+    for (auto &tile : tiles) {
+        tile.clear();
+    }
+    signatures.assign(tiles.size(), 0);
+}
+
+void TileIndex::Stamp(const TileIndex *previous) {
+    const uint32_t stamp = ++lastStamp;
+    const bool comparable = previous != nullptr && previous->size == size;
+    for (size_t i = 0; i < tiles.size(); i++) {
+        if (comparable && previous->tiles[i].size() == tiles[i].size() && previous->signatures[i] == signatures[i]) {
+            stamps[i] = previous->stamps[i];
+        } else {
+            stamps[i] = stamp;
+        }
+    }
+}
+
+int TileIndex::Wrap(int from, int count, int size, int *ranges) {
+    if (count <= 0 || size <= 0) return 0;
+    if (count >= size) {
+        ranges[0] = 0;
+        ranges[1] = size;
+        return 1;
+    }
+    from %= size;
+    if (from < 0) from += size;
+    ranges[0] = from;
+    ranges[1] = std::min(size, from + count);
+    if (from + count <= size) return 1;
+    ranges[2] = 0;
+    ranges[3] = from + count - size;
+    return 2;
+}
@@ -0,0 +1,98 @@
+//
+//  TileIndex.hpp
+//  LifeGame
+//
+
+#ifndef TileIndex_hpp
+#define TileIndex_hpp
+
+#include <vector>
+#include <algorithm>
+#include "Unit.hpp"
+
+//Buckets units into square tiles so rectangular range queries over the torus touch only overlapped tiles.
+class TileIndex {
+    static const int tileShift = 5;
+    static const int tileSize = 1 << tileShift;
+    
+    std::vector<std::vector<Unit>> tiles;
+    //Order independent hash of each tile's units, which change from generation to generation in no particular order.
+    std::vector<uint64_t> signatures;
+    std::vector<uint32_t> stamps;
+    Geometry::Vector size;
+    Geometry::Vector tilesCount;
+    
+public:
+    constexpr static int TileShift() { return tileShift; }
+    constexpr static int TileSize() { return tileSize; }
+    
+    explicit TileIndex();
+    
+    Geometry::Vector GetSize() const { return size; }
+    Geometry::Vector TilesCount() const { return tilesCount; }
+    const std::vector<Unit> &GetTile(int x, int y) const { return tiles[y * tilesCount.x + x]; }
+    //Changes whenever the tile content changes; stamps are unique across indices, so caches may follow any of them.
+    uint32_t GetStamp(int x, int y) const { return stamps[y * tilesCount.x + x]; }
+    
+    //Tiles that hold the same units as in previous keep its stamps.
+    template <typename Units>
+    void Rebuild(const Units &units, Geometry::Vector size, const TileIndex *previous = nullptr) {
+        Reset(size);
+        for (const auto &unit : units) {
+            Insert(unit);
+        }
+        Stamp(previous);
+    }
+    
+    //Calls func for every unit inside [from, from + count) with both axes wrapped around the field.
+    template <typename Func>
+    void Query(Geometry::Vector from, Geometry::Vector count, Func func) const {
+        int xRanges[4], yRanges[4];
+        const int xSegments = Wrap(from.x, count.x, size.x, xRanges);
+        const int ySegments = Wrap(from.y, count.y, size.y, yRanges);
+        for (int i = 0; i < ySegments; i++) {
+            for (int j = 0; j < xSegments; j++) {
+                QueryRange(xRanges[2 * j], xRanges[2 * j + 1], yRanges[2 * i], yRanges[2 * i + 1], func);
+            }
+        }
+    }
+    
+private:
+    void Reset(Geometry::Vector size);
+    void Stamp(const TileIndex *previous);
+    void Insert(const Unit &unit) {
+        const Geometry::Vector &pos = unit.position;
+        const int tile = (pos.y >> tileShift) * tilesCount.x + (pos.x >> tileShift);
+        tiles[tile].push_back(unit);
+        signatures[tile] += Signature(unit);
+    }
+    
+    static uint64_t Signature(const Unit &unit) {
+        uint64_t x = static_cast<uint64_t>(static_cast<uint32_t>(unit.position.x))
+                   | static_cast<uint64_t>(static_cast<uint32_t>(unit.position.y)) << 32;
+        x ^= static_cast<uint64_t>(static_cast<uint32_t>(unit.player)) * 0x9E3779B97F4A7C15ull;
+        x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+        x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+        return x ^ (x >> 31);
+    }
+    
+    static int Wrap(int from, int count, int size, int *ranges);
+    
+    template <typename Func>
+    void QueryRange(int minX, int maxX, int minY, int maxY, Func &func) const {
+        for (int ty = minY >> tileShift; ty <= (maxY - 1) >> tileShift; ty++) {
+            for (int tx = minX >> tileShift; tx <= (maxX - 1) >> tileShift; tx++) {
+                const bool inside = (tx << tileShift) >= minX && ((tx + 1) << tileShift) <= maxX
+                                 && (ty << tileShift) >= minY && ((ty + 1) << tileShift) <= maxY;
+                for (const auto &unit : GetTile(tx, ty)) {
+                    const Geometry::Vector &pos = unit.position;
+                    if (inside || (pos.x >= minX && pos.x < maxX && pos.y >= minY && pos.y < maxY)) {
+                        func(unit);
+                    }
+                }
+            }
+        }
+    }
+};
+
+#endif /* TileIndex_hpp */
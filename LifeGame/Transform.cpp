@@ -0,0 +1,97 @@
+//
+//  Transform.cpp
+//  LifeGame
+//
+
+#include <iostream>
+#include <cassert>
+#include "Transform.hpp"
+
+namespace Geometry {
+    
+    const int8_t Transform::linear[Transform::orientations][4] = {
+        { 1, 0, 0, 1 },
+        { 0,-1, 1, 0 },
+        {-1, 0, 0,-1 },
+        { 0, 1,-1, 0 },
+        {-1, 0, 0, 1 },
+        { 0,-1,-1, 0 },
+        { 1, 0, 0,-1 },
+        { 0, 1, 1, 0 }
+    };
+    
+    Transform Transform::Identity() {
+        return Transform();
+    }
+    
+    Transform Transform::Translation(Vector position) {
+        return Transform(0, position);
+    }
+    
+    Transform Transform::Rotation(int quarterTurns) {
+        quarterTurns %= 4;
+        if (quarterTurns < 0) quarterTurns += 4;
+        return Transform(static_cast<uint8_t>(quarterTurns), Vector::zero);
+    }
+    
+    Transform Transform::Scale(Vector scale) {
+        assert((scale.x == 1 || scale.x == -1) && (scale.y == 1 || scale.y == -1));
+        if (scale.x > 0 && scale.y > 0) return Transform(0, Vector::zero);
+        if (scale.x < 0 && scale.y < 0) return Transform(2, Vector::zero);
+        return Transform(scale.x < 0 ? 4 : 6, Vector::zero);
+    }
+    
+    Transform::Transform() : translation(Vector::zero), orientation(0) {}
+    
+    Transform::Transform(uint8_t orientation, Vector translation) : translation(translation), orientation(orientation % orientations) {}
+    
+    void Transform::Apply(const Vector *from, Vector *to, size_t count) const {
+        const int8_t *m = linear[orientation];
+        const int m00 = m[0], m01 = m[1], m10 = m[2], m11 = m[3];
+        const int tx = translation.x, ty = translation.y;
+        for (size_t i = 0; i < count; i++) {
+            const int x = from[i].x;
+            const int y = from[i].y;
+            to[i].x = m00 * x + m01 * y + tx;
+            to[i].y = m10 * x + m11 * y + ty;
+        }
+    }
+    
+    const Transform operator * (const Transform &lhs, const Transform &rhs) {
+        const int8_t *l = Transform::linear[lhs.orientation];
+        const int8_t *r = Transform::linear[rhs.orientation];
+        const int m00 = l[0] * r[0] + l[1] * r[2];
+        const int m01 = l[0] * r[1] + l[1] * r[3];
+        const int m10 = l[2] * r[0] + l[3] * r[2];
+        const int m11 = l[2] * r[1] + l[3] * r[3];
+        uint8_t orientation = 0;
+        for (int i = 0; i < Transform::orientations; i++) {
+            const int8_t *m = Transform::linear[i];
+            if (m[0] == m00 && m[1] == m01 && m[2] == m10 && m[3] == m11) {
+                orientation = static_cast<uint8_t>(i);
+                break;
+            }
+        }
+        return Transform(orientation, lhs * rhs.translation);
+    }
+    
+    const Vector operator * (const Transform &lhs, const Vector &rhs) {
+        Vector result;
+        lhs.Apply(&rhs, &result, 1);
+        return result;
+    }
+    
+    bool operator == (const Transform &lhs, const Transform &rhs) {
+        return lhs.orientation == rhs.orientation && lhs.translation == rhs.translation;
+    }
+    
+    bool operator != (const Transform &lhs, const Transform &rhs) {
+        return !(lhs == rhs);
+    }
+    
+    std::ostream &operator << (std::ostream &lhs, const Transform &rhs) {
+        lhs << static_cast<int>(rhs.orientation) << ' ' << rhs.translation;
+        return lhs;
+    }
+    
+}
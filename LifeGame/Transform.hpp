@@ -0,0 +1,49 @@
+//
+//  Transform.hpp
+//  LifeGame
+//
+
+#ifndef Transform_hpp
+#define Transform_hpp
+
+#include <cstddef>
+#include <stdint.h>
+#include "Vector.hpp"
+
+namespace Geometry {
+    
+    //Exact integer rigid transform: one of the eight square symmetries (D4) followed by a translation.
+    //Orientation index is quarterTurns + 4 * mirrored, where mirroring negates x before rotation.
+    class Transform {
+        static const int orientations = 8;
+        static const int8_t linear[orientations][4];
+        
+        Vector translation;
+        uint8_t orientation;
+        
+    public:
+        constexpr static int Orientations() { return orientations; }
+        
+        static Transform Identity();
+        static Transform Translation(Vector position);
+        static Transform Rotation(int quarterTurns);
+        static Transform Scale(Vector scale);
+        
+        explicit Transform();
+        explicit Transform(uint8_t orientation, Vector translation);
+        
+        uint8_t Orientation() const { return orientation; }
+        Vector GetTranslation() const { return translation; }
+        
+        void Apply(const Vector *from, Vector *to, size_t count) const;
+        
+        friend const Transform operator * (const Transform &lhs, const Transform &rhs);
+        friend const Vector operator * (const Transform &lhs, const Vector &rhs);
+        friend bool operator == (const Transform &lhs, const Transform &rhs);
+        friend bool operator != (const Transform &lhs, const Transform &rhs);
+        friend std::ostream &operator << (std::ostream &lhs, const Transform &rhs);
+    };
+    
+}
+
+#endif /* Transform_hpp */
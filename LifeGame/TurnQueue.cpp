@@ -0,0 +1,29 @@
+//
+//  TurnQueue.cpp
+//  LifeGame
+//
+
+#include <stdexcept>
+#include "TurnQueue.hpp"
+
+namespace Messaging {
+
+    Command &TurnQueue::Next() {
+        if (Size() == capacity) {
+            throw std::overflow_error("Turn queue is full!");
+        }
+        Command &command = commands[back & (capacity - 1)];
+        command.Clear();
+        return command;
+    }
+    
+    Command &TurnQueue::PushFront() {
+        if (Size() == capacity) {
+            throw std::overflow_error("Turn queue is full!");
+        }
+        Command &command = commands[--front & (capacity - 1)];
+        command.Clear();
+        return command;
+    }
+    
+}
@@ -0,0 +1,47 @@
+//
+//  TurnQueue.hpp
+//  LifeGame
+//
+
+#ifndef TurnQueue_hpp
+#define TurnQueue_hpp
+
+#include <stdint.h>
+#include "Command.hpp"
+
+namespace Messaging {
+
+    //Fixed-capacity ring of one player's commands indexed by the running command number.
+    //Applied records stay in their slots and are overwritten later, so turns do not allocate commands.
+    class TurnQueue {
+    public:
+        //A peer is at most two input delays ahead of the slowest one.
+        const static uint32_t capacity = 64;
+        
+    private:
+        Command commands[capacity];
+        uint32_t front;
+        uint32_t back;
+        
+    public:
+        explicit TurnQueue() : front(0), back(0) {}
+        TurnQueue(const TurnQueue &other) = delete;
+        TurnQueue &operator = (const TurnQueue &other) = delete;
+        
+        uint32_t Size() const { return back - front; }
+        bool Empty() const { return back == front; }
+        Command &Front() { return commands[front & (capacity - 1)]; }
+        //Command index places behind the front; index has to be less than Size.
+        const Command &At(uint32_t index) const { return commands[(front + index) & (capacity - 1)]; }
+        void Pop() { front++; }
+        //Returns the cleared slot behind the last command; Push makes it part of the queue.
+        Command &Next();
+        void Push() { back++; }
+        //Inserts a cleared command before the front, for turns that come before commands already received.
+        Command &PushFront();
+        void Clear() { front = back; }
+    };
+    
+}
+
+#endif /* TurnQueue_hpp */
@@ -0,0 +1,29 @@
+//
+//  Unit.hpp
+//  LifeGame
+//
+
+#ifndef Unit_hpp
+#define Unit_hpp
+
+#include "Geometry.h"
+
+struct Unit {
+    int player;
+    Geometry::Vector position;
+    
+    Unit(int player, Geometry::Vector position) : player(player), position(position) {}
+    
+    friend bool operator == (const Unit &lhs, const Unit &rhs) {
+        return lhs.position == rhs.position;
+    }
+};
+
+template <>
+struct std::hash<Unit> {
+    size_t operator () (const Unit &unit) const {
+        return std::hash<Geometry::Vector>()(unit.position);
+    }
+};
+
+#endif /* Unit_hpp */
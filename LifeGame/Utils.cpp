@@ -8,7 +8,7 @@
 
 #include "Utils.hpp"
 
-std::mt19937 Random::generator = std::mt19937(std::random_device()());
+Random::State Random::generator = Random::State(std::random_device()());
 
 int32_t Random::Next() {
     std::uniform_int_distribution<int32_t> distr;
@@ -17,7 +17,11 @@
 #include <errno.h>
 
 class Random {
-    static std::mt19937 generator;
+public:
+    typedef std::mt19937 State;
+    
+private:
+    static State generator;
     
 public:
     static int32_t Next();
@@ -16,6 +16,7 @@
 //#include <GL/glu.h>
 #endif
 
+#include <algorithm>
 #include <cassert>
 #include <iostream>
 #include <string>
@@ -29,24 +30,45 @@ const int Window::KeyMinus = 45;
 const int Window::KeyPlus = 61;
 const int Window::KeyEscape = 27;
 const int Window::KeySpace = 32;
+const int Window::DiscTextureSize = 64;
+const unsigned char Window::PlayerColors[][3] = {
+    { 255,   0,   0 },
+    {   0, 255,   0 },
+    {   0,   0, 255 },
+    { 255, 255,   0 },
+    { 255,   0, 255 },
+    {   0, 255, 255 },
+    { 255, 255, 255 },
+    { 128, 128, 128 }
+};
 
 Window::Window() :
+    selectedCells(new std::vector<Vector>()),
+    loadedUnitsTRS(Transform::Identity()),
+    discTexture(0),
+    gridList(0),
+    numbersList(0),
+    gridCellSize(0.0f),
+    drawnGeneration(0),
+    idleFrames(0),
+    asleep(false),
+    window(0),
+    cellSelected(false),
+    cameraScrolled(false),
+    rightButtonPressed(false),
+    leftButtonPressed(false),
+    cellSizeRatio(0.05f),
+    cellSize(0.0f),
     cameraMoveSensititity(1.f),
-    unitAngleStep(10.0f),
     unitRadiusRatio(0.3f),
-    cellSizeRatioMin(0.005f),
+    cellSizeRatioMin(0.0001f),
     cellSizeRatioMax(0.1f),
     cellSizeRatioStep(0.01f),
-    cellSizeRatio(0.05f),
-    cellSize(0.0f),
+    gridCellSizeMin(4.0f),
+    densityCellSizeMax(1.0f),
     deltaTime(1000 / 30),
-    window(0),
-    loadedUnitsTRS(Matrix3x3::Identity()),
-    rightButtonPressed(false),
-    leftButtonPressed(false),
-    cellSelected(false),
-    cameraScrolled(false),
-    selectedCells(new std::vector<Vector>()) {}
+    idleFramesMax(30),
+    loadedPreset(0) {}
 
 Window::~Window() {
     if (window != 0) {
@@ -73,19 +95,29 @@ void Window::MainLoop(int &argc, char **argv, const std::string &label, Vector s
     glutMotionFunc(Window::MotionFunc);
     glutPassiveMotionFunc(Window::PassiveMotionFunc);
     glutTimerFunc(deltaTime, Window::Update, 0);
-    if (gameField->TurnTime() > 0) {
-        glutTimerFunc(gameField->TurnTime(), Window::Update, 1);
-    }
+    waker.Attach();
+    CreateDiscTexture();
     RecalculateSize();
+    simulation->Start([this]() { SimulationChanged(); });
+    //Input may arrive before the first frame is drawn, and the handlers read the field through the snapshot.
+    simulation->Acquire(snapshot);
     glutMainLoop();
 }
 
 void Window::Display() {
     Window &instance = Instance();
+    //Also what the waker's redraw requests end up in.
+    instance.Resume();
+    instance.simulation->Acquire(instance.snapshot);
+    instance.drawnGeneration = instance.snapshot->generation;
     glClear(GL_COLOR_BUFFER_BIT);
     instance.DrawGrid();
     instance.DrawCell();
-    instance.DrawPoints();
+    if (instance.cellSize < instance.densityCellSizeMax) {
+        instance.DrawDensity();
+    } else {
+        instance.DrawPoints();
+    }
     instance.DrawNumbers();
     instance.DrawRect();
     glutSwapBuffers();
@@ -103,6 +135,7 @@ void Window::Reshape(int w, int h) {
 
 void Window::MouseFunc(int button, int state, int x, int y) {
     Window &instance = Instance();
+    instance.Wake();
     if (button == GLUT_LEFT_BUTTON) {
         instance.LeftMouseHandle(Vector(x, y), state == GLUT_DOWN);
     } else if (button == GLUT_RIGHT_BUTTON) {
@@ -110,16 +143,21 @@ void Window::MouseFunc(int button, int state, int x, int y) {
     }
 }
 
-void Window::KeyboardFunc(unsigned char key, int x, int y) {
-    Instance().KeyboardHandle(key, Vector(x, y));
+void Window::KeyboardFunc(unsigned char key, int, int) {
+    Window &instance = Instance();
+    instance.Wake();
+    instance.KeyboardHandle(key);
 }
 
-void Window::SpecialFunc(int key, int x, int y) {
-    Instance().SpecialHandle(key, Vector(x, y));
+void Window::SpecialFunc(int key, int, int) {
+    Window &instance = Instance();
+    instance.Wake();
+    instance.SpecialHandle(key);
 }
 
 void Window::MotionFunc(int x, int y) {
     Window &instance = Instance();
+    instance.Wake();
     instance.cellSelected = false;
     instance.loadedUnits = nullptr;
     instance.mousePosition = Vector(x, y);
@@ -132,74 +170,188 @@ void Window::PassiveMotionFunc(int x, int y) {
     Instance().mousePosition = Vector(x, y);
 }
 
-void Window::Update(int value) {
-    const Window &instance = Instance();
-    switch (value) {
-    case 0:
-        instance.gameField->Update();
+void Window::Update(int) {
+    Window &instance = Instance();
+    const Simulation &simulation = *instance.simulation;
+    if (simulation.Finished()) {
+        instance.simulation->Stop();
+        std::exit(EXIT_SUCCESS);
+    }
+    if (simulation.Generation() != instance.drawnGeneration) {
+        instance.idleFrames = 0;
         instance.Refresh();
-        glutTimerFunc(instance.deltaTime, Window::Update, 0);
-        break;
-    case 1:
-        instance.gameField->Turn();
-        glutTimerFunc(instance.gameField->TurnTime(), Window::Update, 1);
-        break;
+    } else if (++instance.idleFrames > instance.idleFramesMax) {
+        //No timer is armed until input or the simulation wakes the loop.
+        //A generation published before asleep was set has not woken anyone, so it is checked once more.
+        instance.asleep = true;
+        const bool changed = simulation.Generation() != instance.drawnGeneration || simulation.Finished();
+        if (!changed || !instance.asleep.exchange(false)) return;
     }
+    glutTimerFunc(instance.deltaTime, Window::Update, 0);
 }
 
 void Window::DrawGrid() {
-    if (cellSizeRatio <= cellSizeRatioMin) return;
-    glColor3f(1.0f, 1.0f, 1.0f);
-    glBegin(GL_LINES);
-    for (float x = cellSize; x < windowSize.x; x += cellSize) {
-        glVertex2f(x, 0.f);
-        glVertex2f(x, windowSize.y);
+    if (cellSize < gridCellSizeMin) return;
+    if (gridList == 0) {
+        gridList = glGenLists(2);
+        numbersList = gridList + 1;
     }
-    for (float y = cellSize; y < windowSize.y; y += cellSize) {
-        glVertex2f(0.f, y);
-        glVertex2f(windowSize.x, y);
+    if (gridCellSize != cellSize || gridWindowSize != windowSize) {
+        gridCellSize = cellSize;
+        gridWindowSize = windowSize;
+        numbersOffset = Vector::one * std::numeric_limits<int>::max();
+        glNewList(gridList, GL_COMPILE);
+        glColor3f(1.0f, 1.0f, 1.0f);
+        glBegin(GL_LINES);
+        for (float x = cellSize; x < windowSize.x; x += cellSize) {
+            glVertex2f(x, 0.f);
+            glVertex2f(x, windowSize.y);
+        }
+        for (float y = cellSize; y < windowSize.y; y += cellSize) {
+            glVertex2f(0.f, y);
+            glVertex2f(windowSize.x, y);
+        }
+        glEnd();
+        glEndList();
     }
-    glEnd();
+    glCallList(gridList);
 }
 
 void Window::DrawPoints() {
-    for (const auto &unit : *gameField->GetUnits()) {
+    const Vector visibleCells(static_cast<int>(windowSize.x / cellSize) + 1, static_cast<int>(windowSize.y / cellSize) + 1);
+    const int lastColor = sizeof(PlayerColors) / sizeof(PlayerColors[0]) - 1;
+    pointVertices.clear();
+    snapshot->tiles.Query(-cellOffset, visibleCells, [this, lastColor](const Unit &unit) {
         Vector pos(unit.position + cellOffset);
-        gameField->ClampVector(pos);
-        switch (unit.player) {
-            case 0: glColor3f(1.0f, 0.0f, 0.0f); break;
-            case 1: glColor3f(0.0f, 1.0f, 0.0f); break;
-            case 2: glColor3f(0.0f, 0.0f, 1.0f); break;
-            case 3: glColor3f(1.0f, 1.0f, 0.0f); break;
-            case 4: glColor3f(1.0f, 0.0f, 1.0f); break;
-            case 5: glColor3f(0.0f, 1.0f, 1.0f); break;
-            case 6: glColor3f(1.0f, 1.0f, 1.0f); break;
-            default:glColor3f(0.5f, 0.5f, 0.5f); break;
+        snapshot->ClampVector(pos);
+        AddPoint(pos, PlayerColors[unit.player < lastColor ? unit.player : lastColor]);
+    });
+    if (loadedUnits != nullptr) {
+        const unsigned char previewColor[3] = { 255, 255, 128 };
+        const Transform transform = Transform::Translation(cellOffset) * loadedUnitsTRS;
+        loadedUnitsPreview.resize(loadedUnits->size());
+        transform.Apply(loadedUnits->data(), loadedUnitsPreview.data(), loadedUnits->size());
+        for (auto &pos : loadedUnitsPreview) {
+            snapshot->ClampVector(pos);
+            AddPoint(pos, previewColor);
         }
-        DrawPoint(pos);
     }
-    if (loadedUnits == nullptr) return;
-    glColor3f(1.0f, 1.0f, 0.5f);
-    for (const auto &unit : *loadedUnits) {
-        Vector pos = Matrix3x3::Translation(cellOffset) * loadedUnitsTRS * unit;
-        gameField->ClampVector(pos);
-        DrawPoint(pos);
+    FlushVertices(true);
+}
+
+void Window::DrawDensity() {
+    int shift = 1;
+    while ((1 << shift) * cellSize < 1.f) shift++;
+    const DensityPyramid::Level &level = density.Update(snapshot->tiles, shift);
+    const float blockSize = (1 << level.shift) * cellSize;
+    const float blockCells = static_cast<float>(1 << (2 * level.shift));
+    const int lastColor = sizeof(PlayerColors) / sizeof(PlayerColors[0]) - 1;
+    pointVertices.clear();
+    for (int y = 0; y < level.size.y; y++) {
+        for (int x = 0; x < level.size.x; x++) {
+            const uint32_t *block = level.Block(x, y);
+            uint32_t total = 0;
+            uint32_t maxCount = 0;
+            int player = 0;
+            for (int i = 0; i < DensityPyramid::players; i++) {
+                total += block[i];
+                if (block[i] > maxCount) {
+                    maxCount = block[i];
+                    player = i;
+                }
+            }
+            if (total == 0) continue;
+            Vector pos = Vector(x << level.shift, y << level.shift) + cellOffset;
+            snapshot->ClampVector(pos);
+            const float density = std::min(1.f, 4.f * total / blockCells);
+            const unsigned char *color = PlayerColors[player < lastColor ? player : lastColor];
+            const float corners[4][2] = { { 0.f, 0.f }, { 1.f, 0.f }, { 1.f, 1.f }, { 0.f, 1.f } };
+            for (int i = 0; i < 4; i++) {
+                PointVertex vertex;
+                vertex.x = pos.x * cellSize + corners[i][0] * blockSize;
+                vertex.y = pos.y * cellSize + corners[i][1] * blockSize;
+                vertex.u = 0.f;
+                vertex.v = 0.f;
+                vertex.color[0] = color[0];
+                vertex.color[1] = color[1];
+                vertex.color[2] = color[2];
+                vertex.color[3] = static_cast<unsigned char>(64.f + 191.f * density);
+                pointVertices.push_back(vertex);
+            }
+        }
     }
+    FlushVertices(false);
 }
 
-void Window::DrawPoint(Vector pos) {
+void Window::AddPoint(Vector pos, const unsigned char *color) {
     const float radius = 0.5f * cellSize;
     const float unitRadius = unitRadiusRatio * cellSize;
     const float x = pos.x * cellSize + radius;
     const float y = pos.y * cellSize + radius;
-    glBegin(GL_POLYGON);
-    for (float i = 0.f; i < 360.f; i += unitAngleStep) {
-        const float radians = i * DegToRad;
-        const float pointX = x + cosf(radians) * unitRadius;
-        const float pointY = y + sinf(radians) * unitRadius;
-        glVertex2f(pointX, pointY);
+    const float corners[4][2] = { { -1.f, -1.f }, { 1.f, -1.f }, { 1.f, 1.f }, { -1.f, 1.f } };
+    for (int i = 0; i < 4; i++) {
+        PointVertex vertex;
+        vertex.x = x + corners[i][0] * unitRadius;
+        vertex.y = y + corners[i][1] * unitRadius;
+        vertex.u = corners[i][0] * 0.5f + 0.5f;
+        vertex.v = corners[i][1] * 0.5f + 0.5f;
+        vertex.color[0] = color[0];
+        vertex.color[1] = color[1];
+        vertex.color[2] = color[2];
+        vertex.color[3] = 255;
+        pointVertices.push_back(vertex);
     }
-    glEnd();
+}
+
+void Window::FlushVertices(bool sprite) {
+    if (pointVertices.empty()) return;
+    const PointVertex *data = pointVertices.data();
+    if (sprite) {
+        glEnable(GL_TEXTURE_2D);
+        glBindTexture(GL_TEXTURE_2D, discTexture);
+        glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+        glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+        glTexCoordPointer(2, GL_FLOAT, sizeof(PointVertex), &data->u);
+    }
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_COLOR_ARRAY);
+    glVertexPointer(2, GL_FLOAT, sizeof(PointVertex), &data->x);
+    glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(PointVertex), data->color);
+    glDrawArrays(GL_QUADS, 0, static_cast<GLsizei>(pointVertices.size()));
+    glDisableClientState(GL_COLOR_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glDisable(GL_BLEND);
+    if (sprite) {
+        glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+        glDisable(GL_TEXTURE_2D);
+    }
+}
+
+void Window::CreateDiscTexture() {
+    const int size = DiscTextureSize;
+    const float radius = 0.5f * size;
+    std::vector<unsigned char> pixels(size * size * 2);
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            const float dx = x + 0.5f - radius;
+            const float dy = y + 0.5f - radius;
+            float alpha = radius - sqrtf(dx * dx + dy * dy);
+            alpha = alpha < 0.f ? 0.f : (alpha > 1.f ? 1.f : alpha);
+            pixels[2 * (y * size + x)] = 255;
+            pixels[2 * (y * size + x) + 1] = static_cast<unsigned char>(alpha * 255.f);
+        }
+    }
+    glGenTextures(1, &discTexture);
+    glBindTexture(GL_TEXTURE_2D, discTexture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_LUMINANCE_ALPHA, size, size, 0, GL_LUMINANCE_ALPHA, GL_UNSIGNED_BYTE, pixels.data());
+    glBindTexture(GL_TEXTURE_2D, 0);
 }
 
 void Window::RecalculateSize() {
@@ -209,10 +361,16 @@ void Window::RecalculateSize() {
 }
 
 void Window::DrawNumbers() {
-    if (cellSizeRatio <= cellSizeRatioMin) return;
+    if (cellSize < gridCellSizeMin) return;
+    if (numbersOffset == cellOffset) {
+        glCallList(numbersList);
+        return;
+    }
+    numbersOffset = cellOffset;
+    glNewList(numbersList, GL_COMPILE_AND_EXECUTE);
     glColor3f(1.0f, 1.0f, 1.0f);
     const float halfSize = cellSize * 0.5f;
-    const Vector &fieldSize = gameField->GetSize();
+    const Vector &fieldSize = snapshot->size;
     for (int x = 0; x < windowSize.x / cellSize; x++) {
         glRasterPos2f(x * cellSize + halfSize, 0.f);
         const int number = (x - cellOffset.x) % fieldSize.x;
@@ -223,11 +381,12 @@ void Window::DrawNumbers() {
         const int number = (y - cellOffset.y) % fieldSize.y;
         DrawNumber(number >= 0 ? number : fieldSize.y + number);
     }
+    glEndList();
 }
 
 void Window::DrawNumber(int number) {
     const std::string &string = std::to_string(number);
-    for (int i = 0; i < string.size(); i++) {
+    for (size_t i = 0; i < string.size(); i++) {
         glutBitmapCharacter(GLUT_BITMAP_TIMES_ROMAN_10, string[i]);
     }
 }
@@ -251,7 +410,7 @@ void Window::DrawRect() {
 void Window::DrawCell() {
     if (!cellSelected || loadedUnits != nullptr) return;
     Vector cell = ScreenToCell(rightButtonPressedPos) + cellOffset;
-    gameField->ClampVector(cell);
+    snapshot->ClampVector(cell);
     const float cellX = cell.x * cellSize;
     const float cellY = cell.y * cellSize;
     glColor3f(1.f, 1.f, 0.5f);
@@ -265,7 +424,13 @@ void Window::DrawCell() {
 
 void Window::Zoom(float zoom) {
     const Vector oldCell = GetCellUnderMouse();
-    cellSizeRatio += zoom;
+    if (zoom < 0.f && cellSizeRatio <= 1.5f * cellSizeRatioStep) {
+        cellSizeRatio *= 0.5f;
+    } else if (zoom > 0.f && cellSizeRatio < 0.75f * cellSizeRatioStep) {
+        cellSizeRatio *= 2.0f;
+    } else {
+        cellSizeRatio += zoom;
+    }
     if (cellSizeRatio < cellSizeRatioMin) cellSizeRatio = cellSizeRatioMin;
     if (cellSizeRatio > cellSizeRatioMax) cellSizeRatio = cellSizeRatioMax;
     RecalculateSize();
@@ -278,17 +443,22 @@ void Window::LeftMouseHandle(Vector mousePos, bool pressed) {
         if (cameraScrolled) {
             cameraScrolled = false;
         } else if (loadedUnits != nullptr) {
-            gameField->AddPreset(loadedUnitsTRS);
+            Simulation::Input input(Simulation::Input::Type::AddPreset);
+            input.transform = loadedUnitsTRS;
+            input.preset = loadedPreset;
+            simulation->Post(input);
             loadedUnits = nullptr;
             cellSelected = false;
         } else {
-            const Vector cell = ScreenToCell(mousePos);
-            gameField->AddUnit(cell);
+            Simulation::Input input(Simulation::Input::Type::AddUnit);
+            input.cell = ScreenToCell(mousePos);
+            simulation->Post(input);
         }
     }
     if (!leftButtonPressed && pressed) {
         leftButtonPressed = true;
-        leftButtonPressedPos = Vector(mousePos.x, windowSize.y - mousePos.y) - cellOffset * cellSize;
+        leftButtonPressedPos = Vector(mousePos.x, windowSize.y - mousePos.y);
+        leftButtonPressedPos -= Vector(static_cast<int>(cellOffset.x * cellSize), static_cast<int>(cellOffset.y * cellSize));
     } else if (leftButtonPressed && !pressed) {
         leftButtonPressed = false;
     }
@@ -303,9 +473,9 @@ void Window::RightMouseHandle(Vector mousePos, bool pressed) {
     if (!rightButtonPressed && pressed) {
         rightButtonPressed = true;
         if (loadedUnits == nullptr) {
-            loadedUnitsTRS = Matrix3x3::Translation(ScreenToCell(mousePos));
+            loadedUnitsTRS = Transform::Translation(ScreenToCell(mousePos));
         } else {
-            loadedUnitsTRS = Matrix3x3::Translation(ScreenToCell(mousePos) - ScreenToCell(rightButtonPressedPos)) * loadedUnitsTRS;
+            loadedUnitsTRS = Transform::Translation(ScreenToCell(mousePos) - ScreenToCell(rightButtonPressedPos)) * loadedUnitsTRS;
         }
         rightButtonPressedPos = mousePos;
     } else if (rightButtonPressed && !pressed) {
@@ -314,16 +484,16 @@ void Window::RightMouseHandle(Vector mousePos, bool pressed) {
     }
 }
 
-void Window::KeyboardHandle(unsigned char key, Vector mousePos) {
+void Window::KeyboardHandle(unsigned char key) {
     switch (key) {
         case KeyEscape:
-            gameField->Destroy();
+            simulation->Post(Simulation::Input(Simulation::Input::Type::Destroy));
             break;
         case KeySpace:
-            if (gameField->TurnTime() == 0) {
-                gameField->Turn();
+            if (snapshot->turnTime == 0) {
+                simulation->Post(Simulation::Input(Simulation::Input::Type::Turn));
             } else {
-                gameField->Pause();
+                simulation->Post(Simulation::Input(Simulation::Input::Type::Pause));
             }
             break;
         case KeyMinus:
@@ -334,7 +504,7 @@ void Window::KeyboardHandle(unsigned char key, Vector mousePos) {
             break;
         default:
             if (key >= '0' && key <= '9') {
-                NumbersHandle(key, mousePos);
+                NumbersHandle(key);
             } else {
                 cellSelected = false;
                 loadedUnits = nullptr;
@@ -343,17 +513,17 @@ void Window::KeyboardHandle(unsigned char key, Vector mousePos) {
     }
 }
 
-void Window::SpecialHandle(int key, Vector mousePos) {
+void Window::SpecialHandle(int key) {
     if (loadedUnits == nullptr) return;
     switch (key) {
-        case GLUT_KEY_LEFT:  loadedUnitsTRS = loadedUnitsTRS * Matrix3x3::Rotation(90.f);       break;
-        case GLUT_KEY_RIGHT: loadedUnitsTRS = loadedUnitsTRS * Matrix3x3::Rotation(-90.f);      break;
-        case GLUT_KEY_UP:    loadedUnitsTRS = loadedUnitsTRS * Matrix3x3::Scale(Vector(1, -1)); break;
-        case GLUT_KEY_DOWN:  loadedUnitsTRS = loadedUnitsTRS * Matrix3x3::Scale(Vector(-1, 1)); break;
+        case GLUT_KEY_LEFT:  loadedUnitsTRS = loadedUnitsTRS * Transform::Rotation(1);          break;
+        case GLUT_KEY_RIGHT: loadedUnitsTRS = loadedUnitsTRS * Transform::Rotation(-1);         break;
+        case GLUT_KEY_UP:    loadedUnitsTRS = loadedUnitsTRS * Transform::Scale(Vector(1, -1)); break;
+        case GLUT_KEY_DOWN:  loadedUnitsTRS = loadedUnitsTRS * Transform::Scale(Vector(-1, 1)); break;
     }
 }
 
-void Window::NumbersHandle(unsigned char key, Vector mousePos) {
+void Window::NumbersHandle(unsigned char key) {
     const auto cells = GetSelectedCells();
     if (!cells->empty()) {
         gameField->SavePreset(key, cells);
@@ -362,6 +532,7 @@ void Window::NumbersHandle(unsigned char key, Vector mousePos) {
     const auto newLoadedUnits = gameField->LoadPreset(key);
     if (cellSelected && loadedUnits != newLoadedUnits) {
         loadedUnits = newLoadedUnits;
+        loadedPreset = key;
     } else {
         loadedUnits = nullptr;
         cellSelected = false;
@@ -370,11 +541,10 @@ void Window::NumbersHandle(unsigned char key, Vector mousePos) {
 
 void Window::CameraScroll(Vector pos) {
     const float sensitivity = cameraMoveSensititity;
-    const Vector &fieldSize = gameField->GetSize();
+    const Vector &fieldSize = snapshot->size;
     Vector newOffset = Vector(pos.x, windowSize.y - pos.y) - leftButtonPressedPos;
     cameraScrolled = Vector::Dot(newOffset, newOffset) >= cellSize * cellSize;
-    newOffset *= sensitivity;
-    newOffset /= cellSize;
+    newOffset = Vector(static_cast<int>(newOffset.x * sensitivity / cellSize), static_cast<int>(newOffset.y * sensitivity / cellSize));
     newOffset.x %= fieldSize.x;
     newOffset.y %= fieldSize.y;
     cellOffset = newOffset;
@@ -383,7 +553,7 @@ void Window::CameraScroll(Vector pos) {
 Vector Window::ScreenToCell(int x, int y) const {
     Vector result(x / cellSize, (windowSize.y - y) / cellSize);
     result -= cellOffset;
-    gameField->ClampVector(result);
+    snapshot->ClampVector(result);
     return result;
 }
 
@@ -391,10 +561,15 @@ Vector Window::ScreenToCell(Vector vec) const {
     return ScreenToCell(vec.x, vec.y);
 }
 
+Vector Window::ScreenToCellUnclamped(Vector vec) const {
+    const Vector cell(static_cast<int>(floorf(vec.x / cellSize)), static_cast<int>(floorf((windowSize.y - vec.y) / cellSize)));
+    return cell - cellOffset;
+}
+
 Vector Window::CellToScreen(int x, int y) const {
     Vector result(x, y);
     result += cellOffset;
-    gameField->ClampVector(result);
+    snapshot->ClampVector(result);
     result *= cellSize;
     result += Vector(cellSize, cellSize) / 2;
     result.y = windowSize.y - result.y;
@@ -407,39 +582,29 @@ Vector Window::CellToScreen(Vector vec) const {
 
 void Window::CalulateSelectedCells() const {
     selectedCells->clear();
-    Vector min = mousePosition;
-    Vector max = rightButtonPressedPos;
-    if (min.x > max.x) {
-        const int tempX = min.x;
-        min.x = max.x;
-        max.x = tempX;
-    }
-    if (min.y > max.y) {
-        const int tempY = min.y;
-        min.y = max.y;
-        max.y = tempY;
-    }
-    const Rect screentRect(min, max - min);
+    if (snapshot == nullptr || rightButtonPressedPos == mousePosition) return;
+    const Vector &fieldSize = snapshot->size;
+    const Vector first = ScreenToCellUnclamped(rightButtonPressedPos);
+    const Vector second = ScreenToCellUnclamped(mousePosition);
+    const Vector from(std::min(first.x, second.x), std::min(first.y, second.y));
+    Vector count = Vector(std::max(first.x, second.x), std::max(first.y, second.y)) - from + Vector::one;
+    count.x = std::min(count.x, fieldSize.x);
+    count.y = std::min(count.y, fieldSize.y);
     Vector cellMin = Vector::one * std::numeric_limits<int>::max();
     Vector cellMax = Vector::one * std::numeric_limits<int>::min();
-    for (const auto &unit : *gameField->GetUnits()) {
-        Vector screenUnit = CellToScreen(unit.position);
-        if (screentRect.Contains(screenUnit)) {
-            cellMin.x = screenUnit.x < cellMin.x ? screenUnit.x : cellMin.x;
-            cellMin.y = screenUnit.y < cellMin.y ? screenUnit.y : cellMin.y;
-            cellMax.x = screenUnit.x > cellMax.x ? screenUnit.x : cellMax.x;
-            cellMax.y = screenUnit.y > cellMax.y ? screenUnit.y : cellMax.y;
-            selectedCells->push_back(screenUnit);
-        }
-    }
-    const Rect rect(cellMin, cellMax - cellMin);
-    const Vector center = rect.Center();
-    std::vector<Vector> &vec = *selectedCells.get();
-    for (int i = 0; i < vec.size(); i++) {
-        vec[i] = vec[i] - center;
-        float cellX = vec[i].x / cellSize;
-        float cellY = vec[i].y / cellSize;
-        vec[i] = Vector(ceilf(cellX + 0.5f), -ceilf(cellY + 0.5f));
+    snapshot->tiles.Query(from, count, [&](const Unit &unit) {
+        //Position relative to the selection corner, unwrapped so a region across the field edge stays contiguous.
+        Vector cell = unit.position - from;
+        snapshot->ClampVector(cell);
+        cellMin.x = std::min(cellMin.x, cell.x);
+        cellMin.y = std::min(cellMin.y, cell.y);
+        cellMax.x = std::max(cellMax.x, cell.x);
+        cellMax.y = std::max(cellMax.y, cell.y);
+        selectedCells->push_back(cell);
+    });
+    const Vector center((cellMin.x + cellMax.x) / 2, (cellMin.y + cellMax.y) / 2);
+    for (auto &cell : *selectedCells) {
+        cell -= center;
     }
 }
 
@@ -450,14 +615,32 @@ const std::shared_ptr<std::vector<Vector>> Window::GetSelectedCells() const {
     return selectedCells;
 }
 
-void Window::Init(std::shared_ptr<GameField> gameField) {
+void Window::Init(std::shared_ptr<GameField> gameField, std::shared_ptr<Simulation> simulation) {
     this->gameField = gameField;
+    this->simulation = simulation;
 }
 
 void Window::Refresh() const {
     glutPostRedisplay();
 }
 
+void Window::Wake() {
+    Refresh();
+    Resume();
+}
+
+void Window::Resume() {
+    if (!asleep.exchange(false)) return;
+    idleFrames = 0;
+    glutTimerFunc(deltaTime, Window::Update, 0);
+}
+
+void Window::SimulationChanged() {
+    if (asleep) {
+        waker.Post();
+    }
+}
+
 Vector Window::GetCellUnderMouse() const {
     return ScreenToCell(mousePosition.x, mousePosition.y);
 }
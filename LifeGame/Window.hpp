@@ -11,13 +11,25 @@
 
 #include <memory>
 #include <vector>
+#include <atomic>
 #include "Geometry.h"
+#include "Simulation.hpp"
+#include "DensityPyramid.hpp"
+#include "LoopWaker.hpp"
 
 class Window {
     const static int KeyMinus;
     const static int KeyPlus;
     const static int KeyEscape;
     const static int KeySpace;
+    const static int DiscTextureSize;
+    const static unsigned char PlayerColors[][3];
+    
+    struct PointVertex {
+        float x, y;
+        float u, v;
+        unsigned char color[4];
+    };
     
     mutable std::shared_ptr<std::vector<Geometry::Vector>> selectedCells;
     Geometry::Vector rightButtonPressedPos;
@@ -25,7 +37,19 @@ class Window {
     Geometry::Vector cellOffset;
     Geometry::Vector windowSize;
     Geometry::Vector mousePosition;
-    Geometry::Matrix3x3 loadedUnitsTRS;
+    Geometry::Transform loadedUnitsTRS;
+    std::vector<Geometry::Vector> loadedUnitsPreview;
+    std::vector<PointVertex> pointVertices;
+    unsigned int discTexture;
+    unsigned int gridList;
+    unsigned int numbersList;
+    float gridCellSize;
+    Geometry::Vector gridWindowSize;
+    Geometry::Vector numbersOffset;
+    uint32_t drawnGeneration;
+    int idleFrames;
+    //Set while no timer is armed; the simulation thread then wakes the loop through waker.
+    std::atomic<bool> asleep;
     
     int window;
     bool cellSelected;
@@ -35,22 +59,30 @@ class Window {
     float cellSizeRatio;
     float cellSize;
     const float cameraMoveSensititity;
-    const float unitAngleStep;
     const float unitRadiusRatio;
     const float cellSizeRatioMin;
     const float cellSizeRatioMax;
     const float cellSizeRatioStep;
+    const float gridCellSizeMin;
+    const float densityCellSizeMax;
     const unsigned deltaTime;
+    const int idleFramesMax;
     
     std::shared_ptr<class GameField> gameField;
+    std::shared_ptr<Simulation> simulation;
+    Simulation::SnapshotPtr snapshot;
+    DensityPyramid density;
+    LoopWaker waker;
     std::shared_ptr<std::vector<Geometry::Vector>> loadedUnits;
+    unsigned char loadedPreset;
     
 public:
     static Window &Instance();
     
     void MainLoop(int &argc, char **argv, const std::string &label, Geometry::Vector size);
-    void Init(std::shared_ptr<class GameField> gameField);
+    void Init(std::shared_ptr<class GameField> gameField, std::shared_ptr<Simulation> simulation);
     void Refresh() const;
+    void Wake();
     Geometry::Vector GetCellUnderMouse() const;
     const std::shared_ptr<std::vector<Geometry::Vector>> GetSelectedCells() const;
     
@@ -64,9 +96,15 @@ private:
     static void PassiveMotionFunc(int x, int y);
     static void Update(int value);
     
+    void Resume();
+    void SimulationChanged();
+    
     void DrawGrid();
     void DrawPoints();
-    void DrawPoint(Geometry::Vector pos);
+    void AddPoint(Geometry::Vector pos, const unsigned char *color);
+    void DrawDensity();
+    void FlushVertices(bool sprite);
+    void CreateDiscTexture();
     void RecalculateSize();
     void DrawNumbers();
     void DrawNumber(int number);
@@ -76,12 +114,13 @@ private:
     void Zoom(float zoom);
     void LeftMouseHandle(Geometry::Vector mousePos, bool pressed);
     void RightMouseHandle(Geometry::Vector mousePos, bool pressed);
-    void KeyboardHandle(unsigned char key, Geometry::Vector mousePos);
-    void SpecialHandle(int key, Geometry::Vector mousePos);
-    void NumbersHandle(unsigned char key, Geometry::Vector mousePos);
+    void KeyboardHandle(unsigned char key);
+    void SpecialHandle(int key);
+    void NumbersHandle(unsigned char key);
     void CameraScroll(Geometry::Vector pos);
     Geometry::Vector ScreenToCell(int x, int y) const;
     Geometry::Vector ScreenToCell(Geometry::Vector vec) const;
+    Geometry::Vector ScreenToCellUnclamped(Geometry::Vector vec) const;
     Geometry::Vector CellToScreen(int x, int y) const;
     Geometry::Vector CellToScreen(Geometry::Vector vec) const;
     void CalulateSelectedCells() const;
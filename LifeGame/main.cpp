@@ -7,13 +7,17 @@
 //
 
 #include <cstdlib>
+#include <algorithm>
 #include <string>
 #include <sstream>
 #include <iostream>
+#include <thread>
+#include <chrono>
 #include "Window.hpp"
 #include "Presets.hpp"
 #include "GameField.hpp"
 #include "Peer.hpp"
+#include "Soak.hpp"
 
 struct {
     Geometry::Vector field = Geometry::Vector(1000, 1000);
@@ -26,34 +30,112 @@ struct {
 #endif
     std::string label = "LifeGame";
     bool master = true;
+    //Headless master of a star game that relays the players' commands.
+    bool relay = false;
+    bool spectator = false;
+    //Shows the local player's input at once and corrects the field when other players' commands arrive.
+    bool predict = false;
+    //Runs the peer without a window until the game ends, e.g. to measure it under an impairment profile.
+    bool headless = false;
+    //Logs turns per second, stalls and input latency every hundred turns.
+    bool report = false;
+    //Name of the network impairment profile other peers reach this one through, empty for a direct link.
+    std::string impair;
+    //Plays a match of headless peers in this process and checks that they agree, instead of opening a window.
+    bool soak = false;
+    Soak::Options soakOptions;
     unsigned turnTime = 100;
     int players = 1;
 } args;
 
 void Parse(int argc, char **argv);
+int RunSoak(std::shared_ptr<Presets> presets);
 
 int main(int argc, char **argv) {
     Parse(argc, argv);
     std::shared_ptr<Peer> peer;
     std::shared_ptr<GameField> gameField;
     std::shared_ptr<Presets> presets = std::make_shared<Presets>(args.presetPath);
+    if (args.soak) {
+        return RunSoak(presets);
+    }
 	
     if (args.master) {
         gameField = std::make_shared<GameField>(presets, args.field, args.turnTime, 0);
-        peer = std::make_shared<Peer>(gameField, args.players);
-        args.address = peer->Address();
+        peer = std::make_shared<Peer>(gameField, args.players, args.relay ? Peer::Topology::Star : Peer::Topology::Mesh);
     } else {
         gameField = std::make_shared<GameField>(presets);
-        peer = std::make_shared<Peer>(gameField, args.address);
+        peer = std::make_shared<Peer>(gameField, args.address, args.spectator);
+    }
+    peer->SetPrediction(args.predict);
+    peer->SetReport(args.report);
+    if (!args.impair.empty()) {
+        const Network::ImpairmentProfile *profile = Network::ImpairmentProfile::Find(args.impair);
+        if (profile == nullptr) {
+            std::cout << "Unknown impairment profile " << args.impair << ", expected one of:";
+            for (const auto &it : Network::ImpairmentProfile::Profiles()) {
+                std::cout << " " << it.name;
+            }
+            std::cout << std::endl;
+            return 1;
+        }
+        peer->SetImpairment(*profile);
     }
     peer->Init();
+    if (args.master) {
+        args.address = peer->PublicAddress();
+    }
+    if (args.relay || args.headless) {
+        std::cout << (args.relay ? "Relay " : "Peer ") << args.address << std::endl;
+        Simulation simulation(gameField);
+        simulation.Start();
+        while (!simulation.Finished()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        simulation.Stop();
+        return 0;
+    }
     Window &instance = Window::Instance();
-    instance.Init(gameField);
-	args.label += std::string(args.master ? " Master " : " Slave ") + args.address;
+    instance.Init(gameField, std::make_shared<Simulation>(gameField));
+	args.label += std::string(args.master ? " Master " : args.spectator ? " Spectator " : " Slave ") + args.address;
     instance.MainLoop(argc, argv, args.label, args.window);
     return 0;
 }
 
+int RunSoak(std::shared_ptr<Presets> presets) {
+    Soak::Options &options = args.soakOptions;
+    options.field = args.field;
+    options.topology = args.relay ? Peer::Topology::Star : Peer::Topology::Mesh;
+    options.predict = args.predict;
+    options.report = args.report;
+    //"all" plays the match once per impairment profile.
+    std::vector<const Network::ImpairmentProfile *> profiles;
+    if (args.impair == "all") {
+        for (const auto &profile : Network::ImpairmentProfile::Profiles()) {
+            profiles.push_back(&profile);
+        }
+    } else if (!args.impair.empty()) {
+        profiles.push_back(Network::ImpairmentProfile::Find(args.impair));
+        if (profiles.back() == nullptr) {
+            std::cout << "Unknown impairment profile " << args.impair << std::endl;
+            return 1;
+        }
+    } else {
+        profiles.push_back(nullptr);
+    }
+    bool passed = true;
+    for (const Network::ImpairmentProfile *profile : profiles) {
+        options.impairment = profile;
+        std::cout << "Soak with " << (profile != nullptr ? profile->name : "direct") << " links" << std::endl;
+        Soak soak(presets, options);
+        if (!soak.Run()) {
+            std::cout << "Soak failed" << std::endl;
+            passed = false;
+        }
+    }
+    return passed ? 0 : 1;
+}
+
 void Parse(int argc, char **argv) {
     for (int i = 1; i < argc; i++) {
         if (std::strcmp("field", argv[i]) == 0) {
@@ -68,6 +150,11 @@ void Parse(int argc, char **argv) {
 			args.address = std::string(argv[++i]);
             args.master = false;
         }
+        if (std::strcmp("spectate", argv[i]) == 0) {
+            args.address = std::string(argv[++i]);
+            args.master = false;
+            args.spectator = true;
+        }
         if (std::strcmp("presets", argv[i]) == 0) {
             args.presetPath = argv[++i];
         }
@@ -78,6 +165,30 @@ void Parse(int argc, char **argv) {
             }
             args.turnTime = turnTime > 0 ? 1000 / turnTime : 0;
         }
+        if (std::strcmp("predict", argv[i]) == 0) {
+            args.predict = true;
+        }
+        if (std::strcmp("relay", argv[i]) == 0) {
+            args.relay = true;
+        }
+        if (std::strcmp("headless", argv[i]) == 0) {
+            args.headless = true;
+        }
+        if (std::strcmp("report", argv[i]) == 0) {
+            args.report = true;
+        }
+        if (std::strcmp("impair", argv[i]) == 0) {
+            args.impair = argv[++i];
+        }
+        if (std::strcmp("soak", argv[i]) == 0) {
+            args.soak = true;
+            args.soakOptions.players = std::max(1, std::min(atoi(argv[++i]), static_cast<int>(GameField::maxPlayers)));
+            args.soakOptions.turns = static_cast<uint32_t>(std::max(1, atoi(argv[++i])));
+            args.soakOptions.turnTime = static_cast<unsigned>(std::max(1, atoi(argv[++i])));
+        }
+        if (std::strcmp("cpuload", argv[i]) == 0) {
+            args.soakOptions.maxCpuLoad = std::max(0, std::min(atoi(argv[++i]), 100));
+        }
         if (std::strcmp("players", argv[i]) == 0) {
             int players = atoi(argv[++i]);
             if (players > 0) {
@@ -88,4 +199,8 @@ void Parse(int argc, char **argv) {
             }
         }
     }
+    //The relay takes a player slot of its own, which never issues any input.
+    if (args.relay && args.master) {
+        args.players = std::min(args.players + 1, static_cast<int>(GameField::maxPlayers));
+    }
 }